@@ -0,0 +1,227 @@
+/**
+ * Headless microbenchmarks of the editor core, run by `make bench`.
+ *
+ * The editor is compiled into this file, so the static functions measured here
+ * are the ones the editor runs, only without a terminal. Input is generated
+ * from a fixed seed, so runs are comparable across builds.
+ */
+#include "../src/snack.c"
+
+/* Constants */
+#define BENCH_SCREEN  50         // Lines of the first screen
+#define BENCH_TYPED   100000     // Characters typed mid-line
+#define BENCH_DELETED 50000      // Characters deleted mid-line, every other one
+#define BENCH_MOVES   1000000    // Lines moved through
+#define BENCH_LONG    1048576    // Long line length in bytes
+#define BENCH_COUNTS  100        // Long lines counted
+#define BENCH_SEED    2463534242 // Seed of every generated input
+
+/* Internal functions */
+static void     bench_buffer(char *filename);                          // Replace the current buffer
+static void     bench_generate(const char *path, size_t size);         // Write the input file unless it exists
+static void     bench_report(const char *name, size_t ops, uint64_t ns, size_t allocations);
+static unsigned int bench_random();                                    // Next pseudo-random number
+
+/* State variables */
+static unsigned int bench_seed; // Input content (xorshift)
+
+int main(int argc, char *argv[]) {
+  const char *path;
+  size_t      size;
+  Selection   s;
+  uint64_t    start;
+  size_t      allocations;
+  size_t      i;
+
+  // The defaults are BENCHFILE and BENCHSIZE in config.mk, passed by make bench
+  if (argc != 3)
+    errx(EX_USAGE, "usage: bench FILE SIZE_MB");
+  path = argv[1];
+  size = strtoul(argv[2], NULL, 10) * 1048576;
+
+  setlocale(LC_ALL, "");
+  internal_setup();
+  bench_generate(path, size);
+
+  printf("%-32s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op");
+
+  // Load: the first screen, then every line
+  bench_buffer(safe_strdup(path));
+  allocations = safe_allocations;
+  start = internal_clock();
+  internal_loadfile(current_buffer);
+  buffer_split(current_buffer, BENCH_SCREEN);
+  bench_report("load first screen", 1, (internal_clock() - start), (safe_allocations - allocations));
+
+  buffer_split(current_buffer, SIZE_MAX);
+  bench_report("load (per line)", buffer_lines(current_buffer), (internal_clock() - start), (safe_allocations - allocations));
+
+  // The swap journal the editor opens after loading, apart from the load
+  allocations = safe_allocations;
+  start = internal_clock();
+  internal_recover(current_buffer);
+  bench_report("open swap journal", 1, (internal_clock() - start), (safe_allocations - allocations));
+
+  // Cursor movement through the loaded file
+  s.start = s.end = current_buffer->cursor;
+  allocations = safe_allocations;
+  start = internal_clock();
+  for (i = 0; i < BENCH_MOVES; i++)
+    action_move_nextline(current_buffer, &s);
+  bench_report("move next line", BENCH_MOVES, (internal_clock() - start), (safe_allocations - allocations));
+
+  // Typing in the middle of a line, one character at a time
+  bench_buffer(NULL);
+  internal_insert(current_buffer->cursor, "The quick brown fox jumps over the lazy dog, again and again.", 61);
+  current_buffer->cursor->offset = 30;
+  current_mode = Mode_insert;
+  allocations = safe_allocations;
+  start = internal_clock();
+  for (i = 0; i < BENCH_TYPED; i++) {
+    char c[2] = { (char)('a' + (i % 26)), '\0' };
+
+    internal_insert(current_buffer->cursor, c, 1);
+  }
+  bench_report("type mid-line", BENCH_TYPED, (internal_clock() - start), (safe_allocations - allocations));
+  current_mode = Mode_normal;
+
+  // Deleting every other character of the typed line, each deletion cutting a
+  // piece. The line must stay compacted
+  current_buffer->cursor->offset = 30;
+  allocations = safe_allocations;
+  start = internal_clock();
+  for (i = 0; i < BENCH_DELETED; i++) {
+    internal_delete(current_buffer->cursor, 1);
+    current_buffer->cursor->offset++;
+
+    if (current_buffer->cursor->line->pieces_count > PIECES_MAX)
+      errx(EX_SOFTWARE, "Line left with %zu pieces after deleting", current_buffer->cursor->line->pieces_count);
+  }
+  bench_report("delete mid-line", BENCH_DELETED, (internal_clock() - start), (safe_allocations - allocations));
+
+  // UTF-8 validation and counting of a long line
+  {
+    static const char *characters[] = { "a", "b", " ", "é", "ß", "€", "漢", "😀" };
+    char  *line = safe_malloc(BENCH_LONG + 1);
+    size_t length;
+
+    bench_seed = BENCH_SEED;
+    for (length = 0; length + 4 < BENCH_LONG;) {
+      const char *ch = characters[bench_random() % ARRAY_LENGTH(characters)];
+
+      memcpy((line + length), ch, strlen(ch));
+      length += strlen(ch);
+    }
+    line[length] = '\0';
+
+    allocations = safe_allocations;
+    start = internal_clock();
+    for (i = 0; i < BENCH_COUNTS; i++)
+      if (utf8_characters(line) == ERR)
+        errx(EX_SOFTWARE, "Generated line is malformed");
+    bench_report("utf8_characters (1 MB line)", BENCH_COUNTS, (internal_clock() - start), (safe_allocations - allocations));
+
+    free(line);
+  }
+
+  buffer_free(current_buffer);
+
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * Internal functions
+ */
+
+void bench_buffer(char *filename) {
+  buffer_free(current_buffer);
+  current_buffer = buffer_new();
+  current_buffer->journal.budget = undo_budget;
+  current_buffer->filename = filename;
+  buffers[0].buffer = current_buffer;
+}
+
+void bench_generate(const char *path, size_t size) {
+  static const char *words[] = { "snack", "buffer", "line", "piece", "cursor", "über", "naïve", "日本語", "→", "x" };
+  struct stat st;
+  char       *chunk;
+  size_t      used    = 0;
+  size_t      written = 0;
+  FILE       *f;
+
+  // The content only depends on the seed, so a file of the right size is it
+  if (stat(path, &st) == 0 && (size_t)st.st_size == size)
+    return;
+
+  if ((f = fopen(path, "w")) == NULL)
+    err(errno, "Unable to create %s", path);
+
+  bench_seed = BENCH_SEED;
+  chunk = safe_malloc(BUFSIZ * 64);
+  fprintf(stderr, "Generating %zu MB in %s\n", (size / 1048576), path);
+
+  // Lines of 40 to 160 bytes, long enough for a word more
+  while (written < size) {
+    size_t line   = 40 + (bench_random() % 121);
+    size_t length = 0;
+
+    if (line > size - written)
+      line = size - written;
+
+    while (length + 1 < line) {
+      const char *word = words[bench_random() % ARRAY_LENGTH(words)];
+      size_t      n    = strlen(word);
+
+      if (length + n + 2 > line)
+        break;
+
+      if (used + n + 2 > BUFSIZ * 64) {
+        fwrite(chunk, 1, used, f);
+        used = 0;
+      }
+
+      memcpy((chunk + used), word, n);
+      chunk[used + n] = ' ';
+      used += n + 1;
+      length += n + 1;
+    }
+
+    // Pad to the exact length, ending with the line break
+    for (; length + 1 < line; length++) {
+      if (used == BUFSIZ * 64) {
+        fwrite(chunk, 1, used, f);
+        used = 0;
+      }
+      chunk[used++] = '.';
+    }
+
+    if (used == BUFSIZ * 64) {
+      fwrite(chunk, 1, used, f);
+      used = 0;
+    }
+    chunk[used++] = '\n';
+    written += length + 1;
+  }
+
+  fwrite(chunk, 1, used, f);
+  free(chunk);
+
+  if (fclose(f) == EOF)
+    err(errno, "Unable to write %s", path);
+}
+
+void bench_report(const char *name, size_t ops, uint64_t ns, size_t allocations) {
+  if (ops == 0)
+    ops = 1;
+
+  printf("%-32s %12zu %12.1f %12.3f\n", name, ops, ((double)ns / ops), ((double)allocations / ops));
+}
+
+unsigned int bench_random() {
+  bench_seed ^= bench_seed << 13;
+  bench_seed ^= bench_seed >> 17;
+  bench_seed ^= bench_seed << 5;
+
+  return bench_seed;
+}
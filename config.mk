@@ -3,6 +3,8 @@ VERSION = 0.1
 TARGET = snack
 SRCDIR = src
 OBJDIR = build
+BENCHDIR = bench
+TOOLSDIR = tools
 
 # Customize below to fit your system
 
@@ -12,12 +14,18 @@ MANPREFIX = ${PREFIX}/share/man
 
 # includes and libs (ncurses)
 INCS = -I. -I/usr/include
-LIBS = -L/usr/lib -lc -lncurses
+LIBS = -L/usr/lib -lc -lncurses -lpthread
 
-# flags
+# flags (UTF-8 scanning uses SSE2 on x86-64; add -mssse3 to validate non-ASCII text
+# with vectors, -mavx2 or -march=native for AVX2)
 CPPFLAGS = -DVERSION=\"${VERSION}\" -DSIGWINCH=28
 CFLAGS = -g -std=c11 -x c -Wall -Wextra -pedantic -Wno-unused-parameter -O0 ${INCS} ${CPPFLAGS}
 LDFLAGS = ${LIBS}
 
+# benchmarks (make bench): optimised, input generated once in BENCHFILE
+BENCHFLAGS = -std=c11 -x c -Wall -Wextra -pedantic -Wno-unused-parameter -Wno-unused-function -O2 -DBENCH ${INCS} ${CPPFLAGS}
+BENCHFILE = /tmp/snack-bench.txt
+BENCHSIZE = 1024
+
 # compiler and linker
 CC = clang
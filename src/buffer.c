@@ -0,0 +1,2607 @@
+#define _GNU_SOURCE 1 // copy_file_range
+
+#include "buffer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "safe.h"
+#include "utf8.h"
+
+/* Constants */
+#define SWAPMAGIC  "snackswp"     // Swap file header magic (8 bytes)
+#define SWAPRECORD 17             // Swap record header: type, offset, length
+
+// Compacting at PIECES_MAX keeps lines within the largest class, even two
+// lines being joined with a piece cut in each
+_Static_assert((2 * (PIECES_MAX + 2)) <= PIECES_LARGEST, "PIECES_MAX too large for PIECES_CLASSES");
+
+/* Types */
+typedef struct Writer {
+  int           fd;               // Destination
+  int           source;           // Original file, for in-kernel copies (or -1)
+  const char   *original;         // Original buffer
+  size_t        original_length;  // Original buffer length in bytes
+  const char   *span;             // Pending span, grown while input stays contiguous
+  size_t        span_length;      // Pending span length in bytes
+  struct iovec  iov[IOVSIZ];      // Spans queued for writev
+  int           count;            // Spans queued
+} Writer;
+
+typedef struct Batch Batch;
+struct Batch {
+  Line   *first;                  // First line of the batch
+  Line   *last;                   // Last line of the batch
+  Line   *root;                   // Root of the batch's own line index
+  size_t  split;                  // Bytes of original split once the batch is spliced
+  Batch  *next;                   // Next batch in the loader queue
+};
+
+struct Loader {
+  pthread_t       thread;         // Worker splitting lines
+  pthread_mutex_t lock;           // Guards everything below
+  pthread_cond_t  ready;          // Signalled when a batch is queued or the worker ends
+  Batch          *head;           // Batches waiting to be spliced, oldest first
+  Batch          *tail;           // Newest queued batch
+  bool            done;           // Worker has split the whole original buffer
+  bool            cancel;         // Worker should stop at the next batch
+  const char     *original;       // Original buffer (read only, owned by the buffer)
+  size_t          original_length; // Original buffer length in bytes
+  bool            crlf;           // Line breaks are CR LF
+  uint64_t        ns;             // Time the worker took to split (worker only, until done)
+  size_t          split;          // Bytes split by the worker (worker only)
+  Block          *pool;           // Slabs the worker allocates from (worker only)
+  unsigned int    seed;           // Treap priorities of the worker (worker only)
+};
+
+typedef struct SwapHeader {
+  char     magic[8];              // SWAPMAGIC
+  uint64_t size;                  // Size of the file the changes apply to
+  int64_t  mtime;                 // Its modification time
+  uint64_t inode;                 // Its inode, saving replaces it
+} SwapHeader;
+
+struct Swap {
+  pthread_t       thread;         // Writer committing records
+  pthread_mutex_t lock;           // Guards everything below
+  pthread_cond_t  ready;          // Signalled when records are queued or the writer should stop
+  char           *pending;        // Records waiting for the next commit
+  size_t          used;           // Bytes of records pending
+  size_t          capacity;       // Bytes allocated for pending records
+  bool            stop;           // Writer should commit what is left and end
+  bool            failed;         // A commit failed, nothing is journaled anymore
+  int             fd;             // Swap file (writer only, once started)
+  char            path[PATH_MAX]; // Swap file path
+};
+
+/* Internal functions */
+static int    internal_write(Writer *w, const char *c, size_t size);
+static int    internal_write_span(Writer *w);
+static int    internal_write_flush(Writer *w);
+static int    internal_copy(int from, int to);                                 // Copy a file's content over another
+static int    internal_detach(Buffer *b);                                      // Move a mapped original off its file
+static size_t internal_span(Buffer *b, const char **c);                        // Take the next unsplit line
+static char  *internal_reserve(Buffer *b, size_t size);                        // Reserve add buffer space
+static void   internal_compact(Buffer *b, Line *l);                            // Flatten a line into a single piece
+static size_t internal_cut(Buffer *b, Line *l, size_t at);                     // Ensure a piece boundary at offset
+static void   internal_grow(Buffer *b, Line *l, size_t count);                 // Ensure piece capacity
+static void  *internal_pool(Block **pool, size_t size);                        // Carve slab memory
+static Piece *internal_pieces(Buffer *b, size_t capacity);                     // Take a piece list of a size class
+static void   internal_pieces_free(Buffer *b, Piece *pieces, size_t capacity); // Release a piece list
+static size_t internal_scan(Line *l, size_t from, int characters);             // Skip characters from a byte offset
+static int    internal_count(Line *l, size_t from, size_t to);                 // Count characters in a byte range
+static int    internal_cells(Line *l, size_t from, size_t to);                 // Count terminal cells in a byte range
+static int    internal_advance(Line *l, size_t from, int column, int target);  // Count characters up to a display column
+static Checkpoints *internal_checkpoints(Line *l, size_t count, size_t at);    // Extend checkpoints
+static void   internal_invalidate(Line *l, size_t at);                         // Drop checkpoints after an edit
+static void   internal_unlex(Buffer *b, Line *l);                              // Have the highlighter look at an edited line again
+static Line  *internal_put(Buffer *b, Line *l, size_t *at, const char *c, size_t size); // Insert a stable span across lines
+static size_t internal_take(Buffer *b, Line *l, size_t at, size_t size);       // Remove bytes across lines
+static size_t internal_read(Buffer *b, Line *l, size_t at, char *dest, size_t size); // Copy (or measure) bytes across lines
+static Line  *internal_locate(Buffer *b, size_t offset, size_t *at);           // Find the line holding a buffer offset
+static Change *internal_journal(Buffer *b);                                    // Drop redo changes, get the change to coalesce with
+static Change *internal_change(Buffer *b);                                     // Append a change to the journal
+static void   internal_forget(Journal *j, size_t from, size_t to);             // Release changes
+static void   internal_trim(Journal *j);                                       // Drop the oldest groups past the budget
+static size_t internal_find(Buffer *b, Search *s, Line *l, size_t from, size_t to); // Find a match starting in a byte range of a line
+static bool   internal_match(Buffer *b, Line *l, size_t at, const char *c, size_t size); // Compare bytes across lines
+static bool   internal_equal(Line *l, size_t at, const char *c, size_t size);  // Compare bytes of a line
+static off_t  internal_swap_replay(Buffer *b, int fd, const SwapHeader *header, long *replayed); // Apply a swap file, get where its valid records end
+static void   internal_swap_record(Buffer *b, char type, size_t offset, const char *c, size_t size); // Queue a swap record
+static void   internal_swap_close(Buffer *b, bool discard);                    // Commit what is left and stop the writer
+static void  *internal_swap_commit(void *data);                                // Swap writer thread
+static void  *internal_load(void *data);                                       // Loader thread
+static void   internal_load_finish(Buffer *b);                                 // Join the loader and adopt its slabs
+static void   internal_batch(Batch *batch, const char *original, size_t length, size_t split, size_t count, bool crlf, Block **pool, unsigned int *seed); // Split lines into a detached batch
+static void   internal_splice(Buffer *b, Batch *batch);                        // Append a batch after the last line
+static Line  *internal_merge(Line *left, Line *right);                         // Join two line indexes
+static unsigned int internal_priority(unsigned int *seed);                     // Next treap priority
+static void   internal_link(Buffer *b, Line *prev, Line *l);                   // Add a line to the index after another
+static void   internal_unlink(Buffer *b, Line *l);                             // Remove a line from the index
+static void   internal_resize(Line *l, long size);                             // Propagate a length change up the index
+static void   internal_rotate(Buffer *b, Line *l);                             // Rotate a line above its parent
+static void   internal_update(Line *l);                                        // Recompute subtree counts
+
+/* State variables */
+static unsigned int priority_seed = 2463534242; // Treap priorities (xorshift)
+
+Buffer *buffer_new(void) {
+  Buffer *b = (Buffer *)safe_calloc(1, sizeof(Buffer));
+  Line   *l = line_new(b);
+
+  b->cursor = (Position *)safe_calloc(1, sizeof(Position));
+  b->cursor->offset = 0;
+  b->cursor->line = l;
+  b->offset_prev = 0;
+  b->first_line = l;
+  b->last_line = l;
+  b->top = l;
+  b->unlexed = l;
+  b->eol = true;
+  b->original_fd = -1;
+  b->journal.budget = UNDOSIZ;
+  b->journal.sealed = true;
+  internal_link(b, NULL, l);
+
+  return b;
+}
+
+void buffer_free(Buffer *b) {
+  Line  *l;
+  Block *a;
+  Block *p;
+
+  if (b->loader) {
+    pthread_mutex_lock(&b->loader->lock);
+    b->loader->cancel = true;
+    pthread_mutex_unlock(&b->loader->lock);
+    internal_load_finish(b);
+  }
+
+  if (b->swap)
+    internal_swap_close(b, true);
+
+  internal_forget(&b->journal, b->journal.first, b->journal.count);
+  free(b->journal.changes);
+  free(b->cursors);
+
+  // Lines and piece lists go with the pool, only checkpoints (and piece lists
+  // past the largest class) are separate
+  for (l = b->first_line; l != NULL; l = l->next) {
+    free(l->checkpoints);
+    if (l->pieces_capacity > PIECES_LARGEST)
+      free(l->pieces);
+  }
+
+  for (a = b->add; a != NULL; a = p) {
+    p = a->prev;
+    free(a);
+  }
+
+  for (a = b->pool; a != NULL; a = p) {
+    p = a->prev;
+    free(a);
+  }
+
+  if (b->filename != NULL)
+    free(b->filename);
+  if (b->original_mapped)
+    munmap(b->original, b->original_length);
+  else
+    free(b->original);
+  if (b->original_fd != -1)
+    close(b->original_fd);
+  free(b->scratch);
+  free(b->cursor);
+  free(b);
+}
+
+void buffer_attach(Buffer *b, char *original, size_t length, int fd) {
+  const char *c;
+  size_t      size;
+
+  b->original = original;
+  b->original_length = length;
+  b->original_split = 0;
+  b->original_mapped = (fd != -1);
+  b->original_fd = fd;
+  b->file_length = length;
+  b->eol = (length == 0 || original[length - 1] == '\n');
+
+  // A byte order mark stays out of the first line, and the first line break
+  // decides whether the carriage returns of CR LF breaks do too. Both are put
+  // back on saving
+  b->bom = (length >= 3 && memcmp(original, BOM, 3) == 0);
+  if (b->bom)
+    b->original_split = 3;
+
+  c = memchr((original + b->original_split), '\n', (length - b->original_split));
+  b->crlf = (c && c > (original + b->original_split) && c[-1] == '\r');
+
+  size = internal_span(b, &c);
+  line_insert(b, b->first_line, 0, c, size);
+}
+
+size_t buffer_split(Buffer *b, size_t count) {
+  Batch  batch;
+  size_t created = 0;
+
+  // While the loader runs it owns the unsplit tail, so wait for its batches
+  if (b->loader) {
+    size_t lines = buffer_lines(b);
+
+    while (buffer_load_poll(b) && (buffer_lines(b) - lines) < count) {
+      pthread_mutex_lock(&b->loader->lock);
+      while (b->loader->head == NULL && !b->loader->done)
+        pthread_cond_wait(&b->loader->ready, &b->loader->lock);
+      pthread_mutex_unlock(&b->loader->lock);
+    }
+
+    return (buffer_lines(b) - lines);
+  }
+
+  if (buffer_partial(b) && count > 0) {
+    created = buffer_lines(b);
+    internal_batch(&batch, b->original, b->original_length, b->original_split, count, b->crlf, &b->pool, &priority_seed);
+    internal_splice(b, &batch);
+    b->original_split = batch.split;
+    created = buffer_lines(b) - created;
+  }
+
+  return created;
+}
+
+void buffer_load(Buffer *b) {
+  Loader *loader;
+
+  if (b->loader || !buffer_partial(b))
+    return;
+
+  loader = (Loader *)safe_calloc(1, sizeof(Loader));
+  loader->original = b->original;
+  loader->original_length = b->original_length;
+  loader->split = b->original_split;
+  loader->crlf = b->crlf;
+  loader->seed = internal_priority(&priority_seed);
+  pthread_mutex_init(&loader->lock, NULL);
+  pthread_cond_init(&loader->ready, NULL);
+
+  // Without a thread, lines are still split on demand
+  if (pthread_create(&loader->thread, NULL, internal_load, loader) != 0) {
+    pthread_cond_destroy(&loader->ready);
+    pthread_mutex_destroy(&loader->lock);
+    free(loader);
+    return;
+  }
+
+  b->loader = loader;
+}
+
+bool buffer_load_poll(Buffer *b) {
+  Batch *batch;
+  Batch *next;
+  bool   done;
+
+  if (b->loader == NULL)
+    return false;
+
+  pthread_mutex_lock(&b->loader->lock);
+  batch = b->loader->head;
+  b->loader->head = b->loader->tail = NULL;
+  done = b->loader->done;
+  pthread_mutex_unlock(&b->loader->lock);
+
+  for (; batch != NULL; batch = next) {
+    next = batch->next;
+    internal_splice(b, batch);
+    b->original_split = batch->split;
+    free(batch);
+  }
+
+  if (done)
+    internal_load_finish(b);
+
+  return !done;
+}
+
+long buffer_follow(Buffer *b, int fd, size_t length) {
+  Batch   batch;
+  char   *text;
+  char   *end;
+  size_t  size;
+  size_t  got = 0;
+  ssize_t n;
+
+  if (buffer_partial(b) || length <= b->file_length)
+    return 0;
+
+  // Read straight into the add buffer, where the new lines point
+  size = length - b->file_length;
+  text = internal_reserve(b, size);
+
+  while (got < size && (n = pread(fd, (text + got), (size - got), (b->file_length + got))) != 0) {
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      b->add->used -= size;
+      return -1;
+    }
+    got += n;
+  }
+
+  // Only whole lines are taken, the rest is read again once it is complete
+  for (end = text + got; end > text && end[-1] != '\n'; end--);
+  b->add->used -= size - (end - text);
+  size = end - text;
+
+  if (size == 0)
+    return 0;
+
+  // Up to the first line break, the text completes a last line without one
+  // (or the only line of an empty file)
+  if (!b->eol || b->file_length == 0) {
+    char  *newline = memchr(text, '\n', size);
+    size_t first   = newline - text;
+
+    if (b->crlf && first > 0 && text[first - 1] == '\r')
+      first--;
+
+    line_insert(b, b->last_line, b->last_line->length, text, first);
+    text = newline + 1;
+    b->eol = true;
+  }
+
+  b->file_length += size;
+
+  internal_batch(&batch, text, (end - text), 0, SIZE_MAX, b->crlf, &b->pool, &priority_seed);
+  internal_splice(b, &batch);
+
+  if (b->unlexed == NULL)
+    b->unlexed = batch.first;
+
+  return size;
+}
+
+int buffer_save(Buffer *b, bool sync) {
+  static const char newline[] = "\r\n";
+  struct stat st;
+  struct stat saved;
+  char        target[PATH_MAX];
+  char        path[PATH_MAX];
+  char        directory[PATH_MAX];
+  bool        exists;
+  int         error;
+  size_t      i;
+  Line       *l;
+  Writer     *w = (Writer *)buffer_scratch(b, sizeof(Writer));
+
+  // Through symbolic links, so that the link is kept and its file replaced
+  if (realpath(b->filename, target) == NULL) {
+    if (errno != ENOENT)
+      return -1;
+    if (snprintf(target, sizeof(target), "%s", b->filename) >= (int)sizeof(target)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  }
+
+  if (snprintf(path, sizeof(path), "%s.XXXXXX", target) >= (int)sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if ((w->fd = mkstemp(path)) == -1)
+    return -1;
+
+  // Only from the mapped file itself, the path may name another one by now
+  w->source = (b->original_mapped ? b->original_fd : -1);
+  w->original = b->original;
+  w->original_length = b->original_length;
+  w->span = NULL;
+  w->span_length = 0;
+  w->count = 0;
+
+  // Keep the permissions of the file being replaced (mkstemp uses 0600)
+  if ((exists = (stat(target, &st) == 0)))
+    fchmod(w->fd, (st.st_mode & 07777));
+  else {
+    mode_t mask = umask(0);
+
+    umask(mask);
+    fchmod(w->fd, (0666 & ~mask));
+  }
+
+  // From the original, so that an untouched first line follows it in one span
+  if (b->bom && internal_write(w, b->original, 3) == -1)
+    goto fail;
+
+  for (l = b->first_line; l != NULL; l = l->next) {
+    const char *end;
+    const char *limit = b->original + b->original_length;
+    size_t      size  = (b->crlf ? 2 : 1);
+
+    for (i = 0; i < l->pieces_count; i++) {
+      if (internal_write(w, l->pieces[i].c, l->pieces[i].length) == -1)
+        goto fail;
+    }
+
+    if (l->next == NULL && !buffer_partial(b) && !b->eol)
+      break;
+
+    // Reuse the original line break when the line's own last piece ends at
+    // it, so that unchanged runs of lines stay one span. Lines of a CR LF
+    // file keep their own break, which may be a lone LF. New lines, and lines
+    // whose end was edited, take the file's style
+    end = (l->pieces_count ? (l->pieces[l->pieces_count - 1].c + l->pieces[l->pieces_count - 1].length) : NULL);
+    if (end && end >= b->original && end < limit && *end == '\n')
+      error = internal_write(w, end, 1);
+    else if (end && b->crlf && end >= b->original && end + 2 <= limit && memcmp(end, newline, 2) == 0)
+      error = internal_write(w, end, 2);
+    else
+      error = internal_write(w, (newline + 2 - size), size);
+
+    if (error == -1)
+      goto fail;
+  }
+
+  // Whatever was never split is written as is
+  if (buffer_partial(b) && internal_write(w, (b->original + b->original_split), (b->original_length - b->original_split)) == -1)
+    goto fail;
+
+  if (internal_write_span(w) == -1 || internal_write_flush(w) == -1 || fstat(w->fd, &saved) == -1)
+    goto fail;
+
+  // Other links would keep the old file after a rename, so copy the new
+  // content over it. A mapped original moves off that file first, and where
+  // it cannot the file is replaced after all
+  if (exists && st.st_nlink > 1 && (!b->original_mapped || internal_detach(b) == 0)) {
+    int fd;
+
+    if ((fd = open(target, (O_WRONLY | O_TRUNC))) == -1)
+      goto fail;
+
+    // The temporary file is kept then, the file may be cut short
+    if (internal_copy(w->fd, fd) == -1 || (sync && fsync(fd) == -1)) {
+      error = errno;
+      close(fd);
+      close(w->fd);
+      errno = error;
+      return -1;
+    }
+
+    close(fd);
+    close(w->fd);
+    unlink(path);
+  }
+  else {
+    if (sync && fsync(w->fd) == -1)
+      goto fail;
+
+    if (close(w->fd) == -1) {
+      w->fd = -1;
+      goto fail;
+    }
+
+    if (rename(path, target) == -1) {
+      w->fd = -1;
+      goto fail;
+    }
+  }
+
+  // Make the rename itself durable
+  if (sync) {
+    int fd;
+
+    snprintf(directory, sizeof(directory), "%s", target);
+    if ((fd = open(dirname(directory), O_RDONLY)) != -1) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+
+  // Following the file goes on from its new end. Whether it ends with a line
+  // break is unchanged, the last line is written with one exactly when `eol`
+  b->file_length = saved.st_size;
+
+  // Changes up to here are in the file, journal the next ones against it
+  if (b->swap) {
+    internal_swap_close(b, true);
+    buffer_swap_open(b);
+  }
+
+  return 0;
+
+fail:
+  error = errno;
+  if (w->fd != -1)
+    close(w->fd);
+  unlink(path);
+  errno = error;
+
+  return -1;
+}
+
+long buffer_swap_open(Buffer *b) {
+  struct stat st;
+  struct stat held;
+  SwapHeader  header;
+  Swap       *swap;
+  char        directory[PATH_MAX];
+  char        name[PATH_MAX];
+  long        replayed = 0;
+  off_t       end;
+  int         error;
+
+  if (b->swap || b->filename == NULL)
+    return 0;
+
+  memset(&header, 0, sizeof(SwapHeader));
+  memcpy(header.magic, SWAPMAGIC, sizeof(header.magic));
+  if (stat(b->filename, &st) == 0) {
+    header.size = st.st_size;
+    header.mtime = st.st_mtime;
+    header.inode = st.st_ino;
+  }
+
+  swap = (Swap *)safe_calloc(1, sizeof(Swap));
+  snprintf(directory, sizeof(directory), "%s", b->filename);
+  snprintf(name, sizeof(name), "%s", b->filename);
+
+  if (snprintf(swap->path, sizeof(swap->path), "%s/.%s.swp", dirname(directory), basename(name)) >= (int)sizeof(swap->path)) {
+    free(swap);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  // Only one session journals a file. The lock is taken on what the path
+  // names until it still names it, the holder may just have removed it
+  for (;;) {
+    if ((swap->fd = open(swap->path, (O_RDWR | O_CREAT), 0600)) == -1) {
+      free(swap);
+      return -1;
+    }
+
+    if (flock(swap->fd, (LOCK_EX | LOCK_NB)) == -1)
+      goto fail;
+
+    if (fstat(swap->fd, &held) == 0 && stat(swap->path, &st) == 0 && held.st_ino == st.st_ino && held.st_dev == st.st_dev)
+      break;
+
+    close(swap->fd);
+  }
+
+  // Replay what a session that never ended left for this very file, then
+  // append after its last whole record, or start over
+  end = internal_swap_replay(b, swap->fd, &header, &replayed);
+
+  if (ftruncate(swap->fd, end) == -1 || lseek(swap->fd, end, SEEK_SET) == -1 ||
+      (end == 0 && write(swap->fd, &header, sizeof(SwapHeader)) != sizeof(SwapHeader)))
+    goto fail;
+
+  pthread_mutex_init(&swap->lock, NULL);
+  pthread_cond_init(&swap->ready, NULL);
+
+  if ((errno = pthread_create(&swap->thread, NULL, internal_swap_commit, swap)) != 0) {
+    pthread_cond_destroy(&swap->ready);
+    pthread_mutex_destroy(&swap->lock);
+    goto fail;
+  }
+
+  b->swap = swap;
+
+  return replayed;
+
+fail:
+  error = errno;
+  close(swap->fd);
+  free(swap);
+  errno = error;
+
+  return -1;
+}
+
+Line *buffer_insert(Buffer *b, Line *l, size_t *at, const char *c, size_t size) {
+  const char *text;
+  size_t      offset;
+  Change     *last;
+  Change     *change;
+
+  if (size == 0)
+    return l;
+
+  // Typed text lands right after the previous insertion, in the buffer and in
+  // the add buffer, so it extends the same change
+  text = buffer_append(b, c, size);
+  offset = line_offset(l) + *at;
+  last = internal_journal(b);
+
+  if (last && last->insert && (last->offset + last->length) == offset && (last->c + last->length) == text) {
+    last->length += size;
+  }
+  else {
+    change = internal_change(b);
+    change->insert = true;
+    change->offset = offset;
+    change->c = text;
+    change->length = size;
+    internal_trim(&b->journal);
+  }
+
+  internal_swap_record(b, 'i', offset, text, size);
+
+  // Extra cursors are only moved along by batched insertions
+  b->cursors_count = 0;
+
+  return internal_put(b, l, at, text, size);
+}
+
+size_t buffer_cursor_find(Buffer *b, Line *l, int offset) {
+  size_t number = line_number(l);
+  size_t lo = 0;
+  size_t hi = b->cursors_count;
+
+  while (lo < hi) {
+    size_t    mid = lo + (hi - lo) / 2;
+    Position *p = &b->cursors[mid];
+
+    if (p->line == l ? p->offset < offset : line_number(p->line) < number)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+bool buffer_cursor_add(Buffer *b, Line *l, int offset) {
+  size_t i = buffer_cursor_find(b, l, offset);
+
+  if (i < b->cursors_count && b->cursors[i].line == l && b->cursors[i].offset == offset)
+    return false;
+
+  if (b->cursors_count == b->cursors_capacity) {
+    b->cursors_capacity = (b->cursors_capacity ? b->cursors_capacity * 2 : 16);
+    b->cursors = safe_realloc(b->cursors, (b->cursors_capacity * sizeof(Position)));
+  }
+
+  memmove((b->cursors + i + 1), (b->cursors + i), ((b->cursors_count - i) * sizeof(Position)));
+  b->cursors[i].line = l;
+  b->cursors[i].offset = offset;
+  b->cursors_count++;
+
+  return true;
+}
+
+void buffer_insert_cursors(Buffer *b, const char *c, size_t size) {
+  const char *text;
+  Line       *from = NULL;        // Line of the previous cursor, as it was before its insertion
+  int         from_offset = 0;    // Offset of the previous cursor in it
+  Line       *to = NULL;          // Where the rest of that line went
+  int         to_offset = 0;      // Offset it starts at there
+  size_t      primary;            // Place of the main cursor among the extra ones
+  size_t      i;
+
+  if (size == 0)
+    return;
+
+  // One copy of the text serves every cursor
+  text = buffer_append(b, c, size);
+  primary = buffer_cursor_find(b, b->cursor->line, b->cursor->offset);
+  internal_journal(b);
+
+  for (i = 0; i <= b->cursors_count; i++) {
+    Position *p = (i == primary ? b->cursor : &b->cursors[i < primary ? i : i - 1]);
+    Line     *l = p->line;
+    Change   *change;
+    size_t    at;
+
+    // The main cursor may have moved onto an extra one, it gets the text once
+    if (l == from && p->offset == from_offset) {
+      p->line = to;
+      p->offset = to_offset;
+      continue;
+    }
+
+    // Positions are in document order, so only the previous insertion can have
+    // moved this one: the text after it on the same line now follows the text
+    if (l == from)
+      at = line_byte_offset((l = to), (to_offset + (p->offset - from_offset)));
+    else
+      at = line_byte_offset(l, p->offset);
+
+    from = p->line;
+    from_offset = p->offset;
+
+    change = internal_change(b);
+    change->insert = true;
+    change->offset = line_offset(l) + at;
+    change->c = text;
+    change->length = size;
+    internal_swap_record(b, 'i', change->offset, text, size);
+
+    to = p->line = internal_put(b, l, &at, text, size);
+    to_offset = p->offset = line_char_offset(to, at);
+  }
+
+  internal_trim(&b->journal);
+}
+
+size_t buffer_delete(Buffer *b, Line *l, size_t at, size_t size) {
+  size_t  offset = line_offset(l) + at;
+  Change *last;
+  Change *change;
+  char   *text;
+
+  if ((size = internal_read(b, l, at, NULL, size)) == 0)
+    return 0;
+
+  b->cursors_count = 0;
+
+  // Deleting forward stays at the same offset, deleting backward ends where
+  // the previous deletion started
+  last = internal_journal(b);
+
+  if (last && !last->insert && (last->offset == offset || (offset + size) == last->offset)) {
+    change = last;
+  }
+  else {
+    change = internal_change(b);
+    change->insert = false;
+    change->offset = offset;
+  }
+
+  if (change->length + size > change->capacity) {
+    size_t capacity = (change->capacity * 2 > change->length + size ? change->capacity * 2 : change->length + size);
+
+    change->c = safe_realloc((char *)change->c, capacity);
+    b->journal.size += capacity - change->capacity;
+    change->capacity = capacity;
+  }
+
+  text = (char *)change->c;
+
+  if (change->offset == offset) {
+    internal_read(b, l, at, (text + change->length), size);
+  }
+  else {
+    memmove((text + size), text, change->length);
+    internal_read(b, l, at, text, size);
+    change->offset = offset;
+  }
+
+  change->length += size;
+  internal_trim(&b->journal);
+
+  internal_swap_record(b, 'd', offset, NULL, size);
+
+  return internal_take(b, l, at, size);
+}
+
+void buffer_seal(Buffer *b) {
+  b->journal.sealed = true;
+}
+
+bool buffer_undo(Buffer *b, Line **l, size_t *at) {
+  Journal     *j = &b->journal;
+  Change      *change;
+  unsigned int group;
+
+  if (j->current == j->first)
+    return false;
+
+  group = j->changes[j->current - 1].group;
+  b->cursors_count = 0;
+
+  do {
+    size_t from;
+    Line  *line;
+
+    change = &j->changes[--j->current];
+    line = internal_locate(b, change->offset, &from);
+
+    // Removed text goes back through the add buffer, the journal copy may be
+    // dropped later
+    if (change->insert) {
+      internal_take(b, line, from, change->length);
+      internal_swap_record(b, 'd', change->offset, NULL, change->length);
+    }
+    else {
+      internal_put(b, line, &from, buffer_append(b, change->c, change->length), change->length);
+      internal_swap_record(b, 'i', change->offset, change->c, change->length);
+    }
+  } while (j->current > j->first && j->changes[j->current - 1].group == group);
+
+  j->sealed = true;
+  *l = internal_locate(b, change->offset, at);
+
+  return true;
+}
+
+bool buffer_redo(Buffer *b, Line **l, size_t *at) {
+  Journal     *j = &b->journal;
+  Change      *change;
+  size_t       offset;
+  unsigned int group;
+
+  if (j->current == j->count)
+    return false;
+
+  group = j->changes[j->current].group;
+  offset = j->changes[j->current].offset;
+  b->cursors_count = 0;
+
+  do {
+    size_t from;
+    Line  *line;
+
+    change = &j->changes[j->current++];
+    line = internal_locate(b, change->offset, &from);
+
+    // Inserted text is still in the add buffer
+    if (change->insert) {
+      internal_put(b, line, &from, change->c, change->length);
+      internal_swap_record(b, 'i', change->offset, change->c, change->length);
+    }
+    else {
+      internal_take(b, line, from, change->length);
+      internal_swap_record(b, 'd', change->offset, NULL, change->length);
+    }
+  } while (j->current < j->count && j->changes[j->current].group == group);
+
+  j->sealed = true;
+  *l = internal_locate(b, offset, at);
+
+  return true;
+}
+
+void buffer_search_start(Buffer *b, Search *s, const char *pattern, size_t length, bool backward, Line *l, size_t at) {
+  const char *newline;
+  size_t      i;
+
+  if (length > SEARCHMAX)
+    length = SEARCHMAX;
+
+  memcpy(s->pattern, pattern, length);
+  s->length = length;
+  newline = memchr(s->pattern, '\n', length);
+  s->newline = (newline ? (size_t)(newline - s->pattern) : length);
+  s->backward = backward;
+  s->origin = s->line = l;
+  s->origin_at = at;
+  s->wrapped = false;
+  s->done = (length == 0);
+  s->match = NULL;
+  s->match_at = 0;
+
+  // Forward the window shifts by the distance of the byte under its last
+  // position to its last occurrence before that, backward by the distance of
+  // the byte under its first position to its first occurrence after that
+  for (i = 0; i < 256; i++)
+    s->skip[i] = (length ? length : 1);
+
+  if (backward) {
+    for (i = length; i-- > 1;)
+      s->skip[(unsigned char)s->pattern[i]] = i;
+    s->at = at;
+  }
+  else {
+    for (i = 0; (i + 1) < length; i++)
+      s->skip[(unsigned char)s->pattern[i]] = length - 1 - i;
+    s->at = at + 1;
+  }
+}
+
+bool buffer_search_step(Buffer *b, Search *s, size_t budget) {
+  size_t scanned = 0;
+
+  while (!s->done && scanned < budget) {
+    Line  *l    = s->line;
+    bool   last = (s->wrapped && l == s->origin);
+    size_t at;
+
+    // Back on the first line, only the part before the start is left
+    if (s->backward)
+      at = internal_find(b, s, l, (last ? s->origin_at : 0), s->at);
+    else
+      at = internal_find(b, s, l, s->at, (last ? s->origin_at + 1 : SIZE_MAX));
+
+    scanned += l->length + 1;
+
+    if (at != SIZE_MAX) {
+      s->match = l;
+      s->match_at = at;
+      s->done = true;
+    }
+    else if (last) {
+      s->done = true;
+    }
+    else if (s->backward) {
+      // The end of the buffer is only known once everything is split
+      if ((s->line = l->prev) == NULL) {
+        buffer_split(b, SIZE_MAX);
+        s->line = b->last_line;
+        s->wrapped = true;
+      }
+      s->at = SIZE_MAX;
+    }
+    else {
+      if ((s->line = line_next(b, l)) == NULL) {
+        s->line = b->first_line;
+        s->wrapped = true;
+      }
+      s->at = 0;
+    }
+  }
+
+  return !s->done;
+}
+
+size_t buffer_memory(Buffer *b) {
+  size_t memory = sizeof(Buffer) + b->scratch_capacity + b->journal.size;
+  Block *a;
+
+  for (a = b->add; a != NULL; a = a->prev)
+    memory += sizeof(Block) + a->capacity;
+
+  for (a = b->pool; a != NULL; a = a->prev)
+    memory += sizeof(Block) + a->capacity;
+
+  if (!b->original_mapped)
+    memory += b->original_length;
+
+  return memory;
+}
+
+size_t buffer_lines(Buffer *b) {
+  return b->root->lines;
+}
+
+Line *buffer_line(Buffer *b, size_t number) {
+  Line *l = b->root;
+
+  if (number < 1)
+    number = 1;
+  if (number > l->lines)
+    number = l->lines;
+
+  for (;;) {
+    size_t before = (l->left ? l->left->lines : 0);
+
+    if (number <= before) {
+      l = l->left;
+    }
+    else if (number == before + 1) {
+      return l;
+    }
+    else {
+      number -= before + 1;
+      l = l->right;
+    }
+  }
+}
+
+bool buffer_partial(Buffer *b) {
+  return b->original_split < b->original_length;
+}
+
+const char *buffer_append(Buffer *b, const char *c, size_t size) {
+  char *dest = internal_reserve(b, size);
+
+  memcpy(dest, c, size);
+
+  return dest;
+}
+
+void *buffer_scratch(Buffer *b, size_t size) {
+  if (size > b->scratch_capacity) {
+    b->scratch_capacity = (size > BUFSIZ ? size : BUFSIZ);
+    b->scratch = safe_realloc(b->scratch, b->scratch_capacity);
+  }
+
+  return b->scratch;
+}
+
+Line *line_new(Buffer *b) {
+  Line *l = b->lines_free;
+
+  if (l != NULL)
+    b->lines_free = l->next;
+  else
+    l = (Line *)internal_pool(&b->pool, sizeof(Line));
+
+  memset(l, 0, sizeof(Line));
+  l->dirty = true;
+
+  return l;
+}
+
+Line *line_next(Buffer *b, Line *l) {
+  if (l->next == NULL && l == b->last_line)
+    buffer_split(b, SPLITSIZ);
+
+  return l->next;
+}
+
+void line_free(Buffer *b, Line *l) {
+  free(l->checkpoints);
+
+  if (l->pieces)
+    internal_pieces_free(b, l->pieces, l->pieces_capacity);
+
+  l->next = b->lines_free;
+  b->lines_free = l;
+}
+
+size_t line_number(Line *l) {
+  size_t number = (l->left ? l->left->lines : 0) + 1;
+
+  for (; l->parent; l = l->parent) {
+    if (l == l->parent->right)
+      number += (l->parent->left ? l->parent->left->lines : 0) + 1;
+  }
+
+  return number;
+}
+
+size_t line_offset(Line *l) {
+  size_t offset = (l->left ? l->left->bytes : 0);
+
+  for (; l->parent; l = l->parent) {
+    if (l == l->parent->right)
+      offset += (l->parent->left ? l->parent->left->bytes : 0) + l->parent->length + 1;
+  }
+
+  return offset;
+}
+
+int line_insert(Buffer *b, Line *l, size_t at, const char *c, size_t size) {
+  size_t i;
+  Piece *prev;
+  int    characters;
+
+  if (size == 0)
+    return 0;
+
+  internal_invalidate(l, at);
+  i = internal_cut(b, l, at);
+  prev = (i > 0 ? &l->pieces[i - 1] : NULL);
+
+  // Typing at the end of the previous insertion just extends its piece
+  if (prev && (prev->c + prev->length) == c) {
+    prev->length += size;
+  }
+  else {
+    internal_grow(b, l, l->pieces_count + 1);
+    memmove(&l->pieces[i + 1], &l->pieces[i], (l->pieces_count - i) * sizeof(Piece));
+    l->pieces[i].c = c;
+    l->pieces[i].length = size;
+    l->pieces_count++;
+  }
+
+  // Only the inserted span is counted, never the whole line
+  characters = utf8_ncharacters(c, size);
+
+  l->length += size;
+  l->visual_length += characters;
+  if (l->width >= 0)
+    l->width += utf8_ncells(c, size);
+  l->dirty = true;
+  internal_unlex(b, l);
+  internal_resize(l, size);
+
+  if (l->pieces_count > PIECES_MAX)
+    internal_compact(b, l);
+
+  return characters;
+}
+
+void line_delete(Buffer *b, Line *l, size_t at, size_t size) {
+  size_t i;
+  size_t j;
+  size_t k;
+
+  if (size == 0)
+    return;
+
+  internal_invalidate(l, at);
+  i = internal_cut(b, l, at);
+  j = internal_cut(b, l, at + size);
+
+  for (k = i; k < j; k++) {
+    l->visual_length -= utf8_ncharacters(l->pieces[k].c, l->pieces[k].length);
+    if (l->width >= 0)
+      l->width -= utf8_ncells(l->pieces[k].c, l->pieces[k].length);
+  }
+
+  memmove(&l->pieces[i], &l->pieces[j], (l->pieces_count - j) * sizeof(Piece));
+  l->pieces_count -= (j - i);
+  l->length -= size;
+  l->dirty = true;
+  internal_unlex(b, l);
+  internal_resize(l, -(long)size);
+
+  // Deleting mid-piece cuts it in two, so deletions add pieces too
+  if (l->pieces_count > PIECES_MAX)
+    internal_compact(b, l);
+}
+
+Line *line_split(Buffer *b, Line *l, size_t at) {
+  size_t i = internal_cut(b, l, at);
+  size_t k;
+  Line  *n = line_new(b);
+
+  internal_invalidate(l, at);
+
+  internal_grow(b, n, l->pieces_count - i);
+  if (l->pieces_count > i)
+    memcpy(n->pieces, &l->pieces[i], (l->pieces_count - i) * sizeof(Piece));
+  n->pieces_count = (l->pieces_count - i);
+  n->length = (l->length - at);
+
+  // Count whichever side of the split is shorter, cells too if they are known
+  n->width = (l->width >= 0 ? 0 : -1);
+  if ((size_t)n->length <= at) {
+    for (k = 0; k < n->pieces_count; k++) {
+      n->visual_length += utf8_ncharacters(n->pieces[k].c, n->pieces[k].length);
+      if (n->width >= 0)
+        n->width += utf8_ncells(n->pieces[k].c, n->pieces[k].length);
+    }
+    l->visual_length -= n->visual_length;
+    if (n->width >= 0)
+      l->width -= n->width;
+  }
+  else {
+    int head       = 0;
+    int head_cells = 0;
+
+    for (k = 0; k < i; k++) {
+      head += utf8_ncharacters(l->pieces[k].c, l->pieces[k].length);
+      if (n->width >= 0)
+        head_cells += utf8_ncells(l->pieces[k].c, l->pieces[k].length);
+    }
+    n->visual_length = l->visual_length - head;
+    l->visual_length = head;
+    if (n->width >= 0) {
+      n->width = l->width - head_cells;
+      l->width = head_cells;
+    }
+  }
+
+  l->pieces_count = i;
+  l->length = at;
+  l->dirty = true;
+  internal_unlex(b, l);
+  internal_resize(l, -(long)n->length);
+
+  n->prev = l;
+  n->next = l->next;
+  if (n->next)
+    n->next->prev = n;
+  l->next = n;
+  internal_link(b, l, n);
+
+  if (b->last_line == l)
+    b->last_line = n;
+
+  if (l->pieces_count > PIECES_MAX)
+    internal_compact(b, l);
+  if (n->pieces_count > PIECES_MAX)
+    internal_compact(b, n);
+
+  return n;
+}
+
+void line_join(Buffer *b, Line *l) {
+  Line  *n = l->next;
+  size_t k = 0;
+  Piece *last;
+
+  internal_grow(b, l, l->pieces_count + n->pieces_count);
+
+  // Re-merge a piece that was split by a previous line break
+  last = (l->pieces_count ? &l->pieces[l->pieces_count - 1] : NULL);
+  if (last && n->pieces_count && (last->c + last->length) == n->pieces[0].c)
+    last->length += n->pieces[k++].length;
+
+  memcpy(&l->pieces[l->pieces_count], &n->pieces[k], (n->pieces_count - k) * sizeof(Piece));
+  l->pieces_count += (n->pieces_count - k);
+  l->length += n->length;
+  l->visual_length += n->visual_length;
+  l->width = ((l->width >= 0 && n->width >= 0) ? (l->width + n->width) : -1);
+  l->dirty = true;
+  if (b->unlexed == n)
+    b->unlexed = l;
+  internal_unlex(b, l);
+  internal_resize(l, n->length);
+
+  internal_unlink(b, n);
+  l->next = n->next;
+  if (l->next)
+    l->next->prev = l;
+
+  if (b->last_line == n)
+    b->last_line = l;
+  if (b->top == n)
+    b->top = l;
+
+  line_free(b, n);
+
+  if (l->pieces_count > PIECES_MAX)
+    internal_compact(b, l);
+}
+
+size_t line_copy(Line *l, size_t at, char *dest, size_t size) {
+  size_t i;
+  size_t copied = 0;
+
+  for (i = 0; i < l->pieces_count && copied < size; i++) {
+    const Piece *p = &l->pieces[i];
+    size_t length;
+
+    if (at >= p->length) {
+      at -= p->length;
+      continue;
+    }
+
+    length = p->length - at;
+    if (length > size - copied)
+      length = size - copied;
+
+    memcpy(dest + copied, p->c + at, length);
+    copied += length;
+    at = 0;
+  }
+
+  return copied;
+}
+
+size_t line_byte_offset(Line *l, int offset) {
+  Checkpoints *cp;
+  size_t       k;
+
+  if (offset <= 0)
+    return 0;
+  if (offset >= l->visual_length)
+    return (size_t)l->length;
+  if (l->length < CHECKMIN)
+    return internal_scan(l, 0, offset);
+
+  k = (size_t)offset / CHECKSIZ;
+  cp = internal_checkpoints(l, (k + 1), SIZE_MAX);
+
+  return internal_scan(l, cp->points[k].offset, (offset - (int)(k * CHECKSIZ)));
+}
+
+int line_char_offset(Line *l, size_t at) {
+  Checkpoints *cp;
+  size_t       lo;
+  size_t       hi;
+
+  if (at >= (size_t)l->length)
+    return l->visual_length;
+  if (l->length < CHECKMIN)
+    return internal_count(l, 0, at);
+
+  cp = internal_checkpoints(l, SIZE_MAX, at);
+
+  // Last checkpoint at or before the offset
+  for (lo = 0, hi = cp->count; (hi - lo) > 1;) {
+    size_t mid = (lo + hi) / 2;
+
+    if (cp->points[mid].offset <= at)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return (int)(lo * CHECKSIZ) + internal_count(l, cp->points[lo].offset, at);
+}
+
+int line_width(Line *l) {
+  if (l->width < 0)
+    l->width = internal_cells(l, 0, (size_t)l->length);
+
+  return l->width;
+}
+
+int line_column(Line *l, int offset) {
+  Checkpoints *cp;
+  size_t       k;
+  size_t       from;
+
+  if (offset <= 0)
+    return 0;
+  if (offset >= l->visual_length)
+    return line_width(l);
+
+  // Every character of an ASCII line takes a cell
+  if (l->visual_length == l->length)
+    return offset;
+  if (l->length < CHECKMIN)
+    return internal_cells(l, 0, internal_scan(l, 0, offset));
+
+  k = (size_t)offset / CHECKSIZ;
+  cp = internal_checkpoints(l, (k + 1), SIZE_MAX);
+  from = cp->points[k].offset;
+
+  return cp->points[k].column + internal_cells(l, from, internal_scan(l, from, (offset - (int)(k * CHECKSIZ))));
+}
+
+int line_column_offset(Line *l, int column) {
+  Checkpoints *cp;
+  size_t       count;
+  size_t       lo;
+  size_t       hi;
+
+  if (column <= 0)
+    return 0;
+  if (l->visual_length == l->length)
+    return (column < l->visual_length ? column : l->visual_length);
+  if (column >= line_width(l))
+    return l->visual_length;
+  if (l->length < CHECKMIN)
+    return internal_advance(l, 0, 0, column);
+
+  // Extend the checkpoints until one passes the column
+  for (cp = internal_checkpoints(l, 1, SIZE_MAX); cp->points[cp->count - 1].column <= column;) {
+    count = cp->count;
+    cp = internal_checkpoints(l, (count + 1), SIZE_MAX);
+
+    if (cp->count == count)
+      break;
+  }
+
+  // Last checkpoint at or before the column
+  for (lo = 0, hi = cp->count; (hi - lo) > 1;) {
+    size_t mid = (lo + hi) / 2;
+
+    if (cp->points[mid].column <= column)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return (int)(lo * CHECKSIZ) + internal_advance(l, cp->points[lo].offset, cp->points[lo].column, column);
+}
+
+
+/**
+ * Internal functions
+ */
+
+int internal_write(Writer *w, const char *c, size_t size) {
+  if (size == 0)
+    return 0;
+
+  if (w->span && (w->span + w->span_length) == c) {
+    w->span_length += size;
+    return 0;
+  }
+
+  if (internal_write_span(w) == -1)
+    return -1;
+
+  w->span = c;
+  w->span_length = size;
+
+  return 0;
+}
+
+int internal_write_span(Writer *w) {
+  const char *c    = w->span;
+  size_t      size = w->span_length;
+
+  if (c == NULL)
+    return 0;
+
+  w->span = NULL;
+  w->span_length = 0;
+
+#ifdef __linux__
+  // Large unchanged regions of a mapped file never pass through user space
+  if (w->source != -1 && size >= COPYMIN && c >= w->original && (c + size) <= (w->original + w->original_length)) {
+    loff_t offset = (c - w->original);
+
+    if (internal_write_flush(w) == -1)
+      return -1;
+
+    while (size > 0) {
+      ssize_t copied = copy_file_range(w->source, &offset, w->fd, NULL, size, 0);
+
+      if (copied <= 0)
+        break;
+
+      c += copied;
+      size -= copied;
+    }
+
+    if (size == 0)
+      return 0;
+  }
+#endif
+
+  w->iov[w->count].iov_base = (void *)c;
+  w->iov[w->count].iov_len = size;
+
+  if (++(w->count) == IOVSIZ)
+    return internal_write_flush(w);
+
+  return 0;
+}
+
+int internal_write_flush(Writer *w) {
+  struct iovec *iov   = w->iov;
+  int           count = w->count;
+
+  w->count = 0;
+
+  while (count > 0) {
+    ssize_t written = writev(w->fd, iov, count);
+
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    // Skip what was written, resuming inside a partially written span
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return 0;
+}
+
+int internal_copy(int from, int to) {
+  char    buffer[BUFSIZ];
+  ssize_t size;
+
+  if (lseek(from, 0, SEEK_SET) == -1)
+    return -1;
+
+#ifdef __linux__
+  while ((size = copy_file_range(from, NULL, to, NULL, SSIZE_MAX, 0)) > 0)
+    ;
+
+  if (size == 0)
+    return 0;
+  if (errno != EXDEV && errno != EINVAL && errno != ENOSYS)
+    return -1;
+#endif
+
+  // Where the kernel cannot copy, from whatever it got to
+  while ((size = read(from, buffer, sizeof(buffer))) != 0) {
+    char *c = buffer;
+
+    if (size == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    while (size > 0) {
+      ssize_t written = write(to, c, size);
+
+      if (written == -1) {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+
+      c += written;
+      size -= written;
+    }
+  }
+
+  return 0;
+}
+
+int internal_detach(Buffer *b) {
+#ifdef __linux__
+  char *copy = mmap(NULL, b->original_length, (PROT_READ | PROT_WRITE), (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+
+  if (copy == MAP_FAILED)
+    return -1;
+
+  memcpy(copy, b->original, b->original_length);
+  mprotect(copy, b->original_length, PROT_READ);
+
+  // Replaces the file pages at the same address in one step, so pieces stay
+  // valid and the loader may keep splitting meanwhile
+  if (mremap(copy, b->original_length, b->original_length, (MREMAP_MAYMOVE | MREMAP_FIXED), b->original) == MAP_FAILED) {
+    int error = errno;
+
+    munmap(copy, b->original_length);
+    errno = error;
+    return -1;
+  }
+
+  close(b->original_fd);
+  b->original_fd = -1;
+
+  return 0;
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+size_t internal_span(Buffer *b, const char **c) {
+  const char *start = b->original + b->original_split;
+  size_t      left  = b->original_length - b->original_split;
+  const char *end   = memchr(start, '\n', left);
+  size_t      size  = (end ? (size_t)(end - start) : left);
+
+  *c = start;
+  b->original_split += size + (end ? 1 : 0); // Skip new line character
+
+  if (b->crlf && end && size > 0 && start[size - 1] == '\r')
+    size--;
+
+  return size;
+}
+
+char *internal_reserve(Buffer *b, size_t size) {
+  Block *a = b->add;
+  char  *dest;
+
+  if (a == NULL || (a->capacity - a->used) < size) {
+    size_t capacity = (size > ADDSIZ ? size : ADDSIZ);
+
+    a = (Block *)safe_malloc(sizeof(Block) + capacity);
+    a->prev = b->add;
+    a->used = 0;
+    a->capacity = capacity;
+    b->add = a;
+  }
+
+  dest = a->c + a->used;
+  a->used += size;
+
+  return dest;
+}
+
+void internal_compact(Buffer *b, Line *l) {
+  char *dest = internal_reserve(b, l->length);
+
+  line_copy(l, 0, dest, l->length);
+  l->pieces[0].c = dest;
+  l->pieces[0].length = l->length;
+  l->pieces_count = (l->length ? 1 : 0);
+}
+
+size_t internal_cut(Buffer *b, Line *l, size_t at) {
+  size_t i;
+
+  for (i = 0; i < l->pieces_count; i++) {
+    if (at < l->pieces[i].length)
+      break;
+    at -= l->pieces[i].length;
+  }
+
+  // Already on a boundary (or at the end of the line)
+  if (at == 0)
+    return i;
+
+  internal_grow(b, l, l->pieces_count + 1);
+  memmove(&l->pieces[i + 1], &l->pieces[i], (l->pieces_count - i) * sizeof(Piece));
+  l->pieces_count++;
+  l->pieces[i].length = at;
+  l->pieces[i + 1].c += at;
+  l->pieces[i + 1].length -= at;
+
+  return i + 1;
+}
+
+void internal_grow(Buffer *b, Line *l, size_t count) {
+  size_t capacity = (l->pieces_capacity ? l->pieces_capacity : 1);
+  Piece *pieces;
+
+  if (count <= l->pieces_capacity && l->pieces != NULL)
+    return;
+
+  while (capacity < count)
+    capacity *= 2;
+
+  pieces = internal_pieces(b, capacity);
+
+  if (l->pieces) {
+    memcpy(pieces, l->pieces, (l->pieces_count * sizeof(Piece)));
+    internal_pieces_free(b, l->pieces, l->pieces_capacity);
+  }
+
+  l->pieces = pieces;
+  l->pieces_capacity = capacity;
+}
+
+void *internal_pool(Block **pool, size_t size) {
+  Block *a = *pool;
+  void  *ptr;
+
+  size = (size + (sizeof(void *) - 1)) & ~(sizeof(void *) - 1);
+
+  if (a == NULL || (a->capacity - a->used) < size) {
+    a = (Block *)safe_malloc(sizeof(Block) + POOLSIZ);
+    a->prev = *pool;
+    a->used = 0;
+    a->capacity = POOLSIZ;
+    *pool = a;
+  }
+
+  ptr = a->c + a->used;
+  a->used += size;
+
+  return ptr;
+}
+
+Piece *internal_pieces(Buffer *b, size_t capacity) {
+  size_t class = 0;
+  Piece *pieces;
+
+  // Past the largest class from the heap, never into the free lists
+  if (capacity > PIECES_LARGEST)
+    return (Piece *)safe_malloc(capacity * sizeof(Piece));
+
+  while (((size_t)1 << class) < capacity)
+    class++;
+
+  if ((pieces = b->pieces_free[class]) != NULL) {
+    b->pieces_free[class] = *(Piece **)pieces;
+    return pieces;
+  }
+
+  return (Piece *)internal_pool(&b->pool, (((size_t)1 << class) * sizeof(Piece)));
+}
+
+void internal_pieces_free(Buffer *b, Piece *pieces, size_t capacity) {
+  size_t class = 0;
+
+  if (capacity > PIECES_LARGEST) {
+    free(pieces);
+    return;
+  }
+
+  while (((size_t)1 << class) < capacity)
+    class++;
+
+  // Free lists are linked through the first piece
+  *(Piece **)pieces = b->pieces_free[class];
+  b->pieces_free[class] = pieces;
+}
+
+Line *internal_put(Buffer *b, Line *l, size_t *at, const char *c, size_t size) {
+  const char *end = c + size;
+  const char *newline;
+
+  for (;;) {
+    size_t length;
+
+    newline = memchr(c, '\n', (end - c));
+    length = (newline ? newline : end) - c;
+
+    line_insert(b, l, *at, c, length);
+    *at += length;
+
+    if (newline == NULL)
+      return l;
+
+    l = line_split(b, l, *at);
+    *at = 0;
+    c = newline + 1; // Skip new line character
+  }
+}
+
+size_t internal_take(Buffer *b, Line *l, size_t at, size_t size) {
+  size_t removed = 0;
+
+  while (removed < size) {
+    size_t available = l->length - at;
+
+    // Remove the line break, joining the next line onto this one
+    if (available == 0) {
+      if (line_next(b, l) == NULL)
+        break;
+      line_join(b, l);
+      removed++;
+      continue;
+    }
+
+    if (available > size - removed)
+      available = size - removed;
+
+    line_delete(b, l, at, available);
+    removed += available;
+  }
+
+  return removed;
+}
+
+size_t internal_read(Buffer *b, Line *l, size_t at, char *dest, size_t size) {
+  size_t read = 0;
+
+  while (read < size) {
+    size_t available = l->length - at;
+
+    if (available == 0) {
+      if ((l = line_next(b, l)) == NULL)
+        break;
+      if (dest)
+        dest[read] = '\n';
+      read++;
+      at = 0;
+      continue;
+    }
+
+    if (available > size - read)
+      available = size - read;
+
+    if (dest)
+      line_copy(l, at, (dest + read), available);
+    read += available;
+    at += available;
+  }
+
+  return read;
+}
+
+Line *internal_locate(Buffer *b, size_t offset, size_t *at) {
+  Line *l = b->root;
+
+  for (;;) {
+    size_t before = (l->left ? l->left->bytes : 0);
+
+    if (offset < before) {
+      l = l->left;
+    }
+    else if (offset - before <= (size_t)l->length || l->right == NULL) {
+      offset -= before;
+      *at = (offset < (size_t)l->length ? offset : (size_t)l->length);
+      return l;
+    }
+    else {
+      offset -= before + l->length + 1;
+      l = l->right;
+    }
+  }
+}
+
+Change *internal_journal(Buffer *b) {
+  Journal *j = &b->journal;
+
+  internal_forget(j, j->current, j->count);
+  j->count = j->current;
+
+  if (j->sealed || j->current == j->first)
+    return NULL;
+
+  return &j->changes[j->current - 1];
+}
+
+Change *internal_change(Buffer *b) {
+  Journal *j = &b->journal;
+  Change  *change;
+
+  if (j->count == j->capacity) {
+    // Reuse the room left by dropped changes before growing
+    if (j->first > 0 && j->first >= j->count / 2) {
+      memmove(j->changes, (j->changes + j->first), ((j->count - j->first) * sizeof(Change)));
+      j->current -= j->first;
+      j->count -= j->first;
+      j->first = 0;
+    }
+    else {
+      j->capacity = (j->capacity ? j->capacity * 2 : 64);
+      j->changes = safe_realloc(j->changes, (j->capacity * sizeof(Change)));
+    }
+  }
+
+  if (j->sealed)
+    j->group++;
+  j->sealed = false;
+
+  change = &j->changes[j->count++];
+  memset(change, 0, sizeof(Change));
+  change->group = j->group;
+  j->current = j->count;
+  j->size += sizeof(Change);
+
+  return change;
+}
+
+void internal_forget(Journal *j, size_t from, size_t to) {
+  for (; from < to; from++) {
+    if (!j->changes[from].insert)
+      free((char *)j->changes[from].c);
+    j->size -= sizeof(Change) + j->changes[from].capacity;
+  }
+}
+
+void internal_trim(Journal *j) {
+  while (j->size > j->budget && j->first < j->count) {
+    unsigned int group = j->changes[j->first].group;
+
+    for (; j->first < j->count && j->changes[j->first].group == group; j->first++)
+      internal_forget(j, j->first, (j->first + 1));
+
+    if (j->current < j->first)
+      j->current = j->first;
+  }
+}
+
+size_t internal_find(Buffer *b, Search *s, Line *l, size_t from, size_t to) {
+  const char *text;
+  size_t      m = s->length;
+  size_t      i;
+
+  // With a line break, the match can only start where the text before it
+  // ends the line
+  if (s->newline < m) {
+    if ((size_t)l->length < s->newline)
+      return SIZE_MAX;
+
+    i = l->length - s->newline;
+    if (i < from || i >= to || !internal_match(b, l, i, s->pattern, m))
+      return SIZE_MAX;
+
+    return i;
+  }
+
+  if ((size_t)l->length < m)
+    return SIZE_MAX;
+  if (to > (size_t)l->length - m + 1)
+    to = (size_t)l->length - m + 1;
+  if (from >= to)
+    return SIZE_MAX;
+
+  // Lines that were never edited are searched in place
+  if (l->pieces_count == 1) {
+    text = l->pieces[0].c;
+  }
+  else {
+    text = buffer_scratch(b, l->length);
+    line_copy(l, 0, (char *)text, l->length);
+  }
+
+  if (s->backward) {
+    for (i = to; i > from;) {
+      const char *window = text + (i - 1);
+
+      if (*window == s->pattern[0] && memcmp((window + 1), (s->pattern + 1), (m - 1)) == 0)
+        return (i - 1);
+
+      if ((i - from) <= s->skip[(unsigned char)*window])
+        break;
+      i -= s->skip[(unsigned char)*window];
+    }
+
+    return SIZE_MAX;
+  }
+
+  // Let memchr find candidates for the first byte, and skip on mismatches
+  for (i = from; i < to;) {
+    const char *window = memchr((text + i), s->pattern[0], (to - i));
+
+    if (window == NULL)
+      break;
+
+    if (memcmp((window + 1), (s->pattern + 1), (m - 1)) == 0)
+      return (size_t)(window - text);
+
+    i = (window - text) + s->skip[(unsigned char)window[m - 1]];
+  }
+
+  return SIZE_MAX;
+}
+
+bool internal_match(Buffer *b, Line *l, size_t at, const char *c, size_t size) {
+  for (;;) {
+    const char *newline = memchr(c, '\n', size);
+    size_t      length  = (newline ? (size_t)(newline - c) : size);
+
+    // A line break in the pattern has to meet the end of the line
+    if (length > (l->length - at) || (newline && length != (l->length - at)))
+      return false;
+
+    if (!internal_equal(l, at, c, length))
+      return false;
+
+    if (newline == NULL)
+      return true;
+
+    if ((l = line_next(b, l)) == NULL)
+      return false;
+
+    at = 0;
+    c = newline + 1;
+    size -= length + 1;
+  }
+}
+
+bool internal_equal(Line *l, size_t at, const char *c, size_t size) {
+  size_t i;
+
+  for (i = 0; i < l->pieces_count && size > 0; i++) {
+    const Piece *p = &l->pieces[i];
+    size_t       length;
+
+    if (at >= p->length) {
+      at -= p->length;
+      continue;
+    }
+
+    length = p->length - at;
+    if (length > size)
+      length = size;
+
+    if (memcmp((p->c + at), c, length) != 0)
+      return false;
+
+    c += length;
+    size -= length;
+    at = 0;
+  }
+
+  return (size == 0);
+}
+
+off_t internal_swap_replay(Buffer *b, int fd, const SwapHeader *header, long *replayed) {
+  struct stat st;
+  const char *swap;
+  size_t      at = sizeof(SwapHeader);
+
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SwapHeader))
+    return 0;
+
+  if ((swap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    return 0;
+
+  // Changes made to another version of the file would land anywhere
+  if (memcmp(swap, header, sizeof(SwapHeader)) != 0) {
+    munmap((void *)swap, st.st_size);
+    return 0;
+  }
+
+  // The last record may have been cut short by the crash
+  while (((size_t)st.st_size - at) >= SWAPRECORD) {
+    char     type = swap[at];
+    uint64_t offset;
+    uint64_t length;
+    size_t   from;
+    Line    *l;
+
+    memcpy(&offset, (swap + at + 1), sizeof(uint64_t));
+    memcpy(&length, (swap + at + 9), sizeof(uint64_t));
+
+    if ((type != 'i' && type != 'd') || (type == 'i' && length > ((size_t)st.st_size - at - SWAPRECORD)))
+      break;
+
+    // Lines past the offset may not be split yet
+    while (b->root->bytes <= offset && buffer_split(b, LOADSIZ) > 0)
+      ;
+    l = internal_locate(b, offset, &from);
+
+    if (type == 'i')
+      internal_put(b, l, &from, buffer_append(b, (swap + at + SWAPRECORD), length), length);
+    else
+      internal_take(b, l, from, length);
+
+    at += SWAPRECORD + (type == 'i' ? length : 0);
+    (*replayed)++;
+  }
+
+  munmap((void *)swap, st.st_size);
+
+  return at;
+}
+
+void internal_swap_record(Buffer *b, char type, size_t offset, const char *c, size_t size) {
+  Swap    *swap   = b->swap;
+  size_t   length = SWAPRECORD + (type == 'i' ? size : 0);
+  uint64_t value;
+  char    *dest;
+
+  if (swap == NULL)
+    return;
+
+  pthread_mutex_lock(&swap->lock);
+
+  if (!swap->failed) {
+    if (swap->used + length > swap->capacity) {
+      swap->capacity = (swap->capacity ? swap->capacity * 2 : SWAPSIZ);
+      if (swap->capacity < swap->used + length)
+        swap->capacity = swap->used + length;
+      swap->pending = safe_realloc(swap->pending, swap->capacity);
+    }
+
+    dest = swap->pending + swap->used;
+    dest[0] = type;
+    value = offset;
+    memcpy((dest + 1), &value, sizeof(uint64_t));
+    value = size;
+    memcpy((dest + 9), &value, sizeof(uint64_t));
+    if (type == 'i')
+      memcpy((dest + SWAPRECORD), c, size);
+
+    // Wake the writer for the first record of a commit, and when it is full
+    if (swap->used == 0 || (swap->used < SWAPSIZ && swap->used + length >= SWAPSIZ))
+      pthread_cond_signal(&swap->ready);
+    swap->used += length;
+  }
+
+  pthread_mutex_unlock(&swap->lock);
+}
+
+void internal_swap_close(Buffer *b, bool discard) {
+  Swap *swap = b->swap;
+
+  pthread_mutex_lock(&swap->lock);
+  swap->stop = true;
+  pthread_cond_signal(&swap->ready);
+  pthread_mutex_unlock(&swap->lock);
+
+  pthread_join(swap->thread, NULL);
+  pthread_cond_destroy(&swap->ready);
+  pthread_mutex_destroy(&swap->lock);
+
+  close(swap->fd);
+  if (discard)
+    unlink(swap->path);
+
+  free(swap->pending);
+  free(swap);
+  b->swap = NULL;
+}
+
+void *internal_swap_commit(void *data) {
+  Swap  *swap     = (Swap *)data;
+  char  *writing  = NULL;
+  size_t capacity = 0;
+
+  pthread_mutex_lock(&swap->lock);
+
+  for (;;) {
+    struct timespec deadline;
+    char           *records;
+    size_t          used;
+    size_t          size;
+    size_t          written;
+    bool            failed = false;
+
+    while (swap->used == 0 && !swap->stop)
+      pthread_cond_wait(&swap->ready, &swap->lock);
+
+    // Let more records gather, they are all committed together
+    if (!swap->stop && swap->used < SWAPSIZ) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += SWAPTICK / 1000;
+      deadline.tv_nsec += (SWAPTICK % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+
+      while (!swap->stop && swap->used < SWAPSIZ && pthread_cond_timedwait(&swap->ready, &swap->lock, &deadline) == 0)
+        ;
+    }
+
+    if (swap->used == 0)
+      break;
+
+    // Trade buffers, new records are queued in the other one meanwhile
+    records = swap->pending;
+    used = swap->used;
+    swap->pending = writing;
+    swap->used = 0;
+    writing = records;
+    size = swap->capacity;
+    swap->capacity = capacity;
+    capacity = size;
+    pthread_mutex_unlock(&swap->lock);
+
+    for (written = 0; written < used && !failed;) {
+      ssize_t n = write(swap->fd, (writing + written), (used - written));
+
+      if (n == -1 && errno != EINTR)
+        failed = true;
+      else if (n > 0)
+        written += n;
+    }
+
+    if (!failed && fsync(swap->fd) == -1)
+      failed = true;
+
+    pthread_mutex_lock(&swap->lock);
+    if (failed) {
+      swap->failed = true;
+      swap->used = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&swap->lock);
+  free(writing);
+
+  return NULL;
+}
+
+void *internal_load(void *data) {
+  Loader         *loader = (Loader *)data;
+  size_t          count  = SPLITSIZ;
+  Batch          *batch;
+  struct timespec start;
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (loader->split < loader->original_length) {
+    pthread_mutex_lock(&loader->lock);
+    if (loader->cancel) {
+      pthread_mutex_unlock(&loader->lock);
+      break;
+    }
+    pthread_mutex_unlock(&loader->lock);
+
+    batch = (Batch *)safe_malloc(sizeof(Batch));
+    internal_batch(batch, loader->original, loader->original_length, loader->split, count, loader->crlf, &loader->pool, &loader->seed);
+    loader->split = batch->split;
+
+    pthread_mutex_lock(&loader->lock);
+    if (loader->tail)
+      loader->tail->next = batch;
+    else
+      loader->head = batch;
+    loader->tail = batch;
+    pthread_cond_signal(&loader->ready);
+    pthread_mutex_unlock(&loader->lock);
+
+    // Small batches first so the first screens arrive quickly
+    if (count < LOADSIZ)
+      count *= 2;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_mutex_lock(&loader->lock);
+  loader->ns = ((uint64_t)(end.tv_sec - start.tv_sec) * 1000000000) + end.tv_nsec - start.tv_nsec;
+  loader->done = true;
+  pthread_cond_signal(&loader->ready);
+  pthread_mutex_unlock(&loader->lock);
+
+  return NULL;
+}
+
+void internal_load_finish(Buffer *b) {
+  Loader *loader = b->loader;
+  Block  *a;
+  Batch  *batch;
+  Batch  *next;
+
+  pthread_join(loader->thread, NULL);
+  b->split_ns = loader->ns;
+
+  // Batches left over after a cancel are never spliced, their lines go with
+  // the slabs
+  for (batch = loader->head; batch != NULL; batch = next) {
+    next = batch->next;
+    free(batch);
+  }
+
+  // Worker slabs hold spliced lines, so the buffer takes them over. They go
+  // behind the current block, which may still have room
+  if (loader->pool) {
+    for (a = loader->pool; a->prev != NULL; a = a->prev)
+      ;
+    if (b->pool) {
+      a->prev = b->pool->prev;
+      b->pool->prev = loader->pool;
+    }
+    else {
+      b->pool = loader->pool;
+    }
+  }
+
+  pthread_cond_destroy(&loader->ready);
+  pthread_mutex_destroy(&loader->lock);
+  free(loader);
+  b->loader = NULL;
+}
+
+void internal_batch(Batch *batch, const char *original, size_t length, size_t split, size_t count, bool crlf, Block **pool, unsigned int *seed) {
+  Line *last = NULL;
+  Line *p;
+
+  batch->first = batch->root = NULL;
+  batch->next = NULL;
+
+  for (; count > 0 && split < length; count--) {
+    const char *c    = original + split;
+    int         characters;
+    size_t      size = utf8_line(c, (length - split), &characters); // Break and characters in one pass
+    bool        end  = (size < length - split);
+    Line       *l    = (Line *)internal_pool(pool, (sizeof(Line) + sizeof(Piece))); // With its piece
+
+    split += size + (end ? 1 : 0); // Skip new line character
+
+    // The carriage return of a CR LF break stays out of the line
+    if (crlf && end && size > 0 && c[size - 1] == '\r') {
+      size--;
+      characters--;
+    }
+
+    memset(l, 0, sizeof(Line));
+    l->dirty = true;
+    l->pieces = (Piece *)(l + 1);
+    l->pieces[0].c = c;
+    l->pieces[0].length = size;
+    l->pieces_count = l->pieces_capacity = 1;
+    l->length = size;
+    l->visual_length = characters;
+    l->width = (l->visual_length == (int)size ? (int)size : -1); // ASCII takes a cell a character
+    l->priority = internal_priority(seed);
+
+    // Lines arrive in order, so the index is built along its right spine:
+    // lower priority nodes are complete once passed and become the left child
+    for (p = last; p && p->priority < l->priority; p = p->parent)
+      internal_update(p);
+
+    l->left = (p ? p->right : batch->root);
+    if (l->left)
+      l->left->parent = l;
+
+    if (p)
+      p->right = l;
+    else
+      batch->root = l;
+    l->parent = p;
+
+    if (last)
+      last->next = l;
+    else
+      batch->first = l;
+    l->prev = last;
+    last = l;
+  }
+
+  for (p = last; p; p = p->parent)
+    internal_update(p);
+
+  batch->last = last;
+  batch->split = split;
+}
+
+void internal_splice(Buffer *b, Batch *batch) {
+  if (batch->first) {
+    batch->first->prev = b->last_line;
+    b->last_line->next = batch->first;
+    b->last_line = batch->last;
+
+    b->root = internal_merge(b->root, batch->root);
+    b->root->parent = NULL;
+  }
+}
+
+Line *internal_merge(Line *left, Line *right) {
+  if (left == NULL)
+    return right;
+  if (right == NULL)
+    return left;
+
+  if (left->priority > right->priority) {
+    left->right = internal_merge(left->right, right);
+    left->right->parent = left;
+    internal_update(left);
+
+    return left;
+  }
+
+  right->left = internal_merge(left, right->left);
+  right->left->parent = right;
+  internal_update(right);
+
+  return right;
+}
+
+unsigned int internal_priority(unsigned int *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+
+  return *seed;
+}
+
+void internal_link(Buffer *b, Line *prev, Line *l) {
+  Line *p;
+
+  l->priority = internal_priority(&priority_seed);
+  l->left = l->right = NULL;
+  l->lines = 1;
+  l->bytes = l->length + 1;
+
+  // Successor position in the tree: right of prev, or leftmost of its right
+  if (prev == NULL) {
+    l->parent = NULL;
+    b->root = l;
+    return;
+  }
+  else if (prev->right == NULL) {
+    prev->right = l;
+    l->parent = prev;
+  }
+  else {
+    for (p = prev->right; p->left; p = p->left)
+      ;
+    p->left = l;
+    l->parent = p;
+  }
+
+  for (p = l->parent; p; p = p->parent) {
+    p->lines += 1;
+    p->bytes += l->bytes;
+  }
+
+  while (l->parent && l->priority > l->parent->priority)
+    internal_rotate(b, l);
+}
+
+void internal_unlink(Buffer *b, Line *l) {
+  Line *p;
+
+  // Rotate down to a leaf, keeping the heap order
+  while (l->left || l->right) {
+    if (l->right == NULL || (l->left && l->left->priority > l->right->priority))
+      internal_rotate(b, l->left);
+    else
+      internal_rotate(b, l->right);
+  }
+
+  if ((p = l->parent) == NULL) {
+    b->root = NULL;
+    return;
+  }
+
+  if (p->left == l)
+    p->left = NULL;
+  else
+    p->right = NULL;
+
+  for (; p; p = p->parent) {
+    p->lines -= 1;
+    p->bytes -= l->bytes;
+  }
+
+  l->parent = NULL;
+}
+
+void internal_resize(Line *l, long size) {
+  for (; l; l = l->parent)
+    l->bytes += size;
+}
+
+void internal_rotate(Buffer *b, Line *l) {
+  Line *p = l->parent;
+  Line *g = p->parent;
+
+  if (l == p->left) {
+    p->left = l->right;
+    if (l->right)
+      l->right->parent = p;
+    l->right = p;
+  }
+  else {
+    p->right = l->left;
+    if (l->left)
+      l->left->parent = p;
+    l->left = p;
+  }
+
+  p->parent = l;
+  l->parent = g;
+
+  if (g == NULL)
+    b->root = l;
+  else if (g->left == p)
+    g->left = l;
+  else
+    g->right = l;
+
+  internal_update(p);
+  internal_update(l);
+}
+
+void internal_update(Line *l) {
+  l->lines = 1;
+  l->bytes = l->length + 1;
+
+  if (l->left) {
+    l->lines += l->left->lines;
+    l->bytes += l->left->bytes;
+  }
+
+  if (l->right) {
+    l->lines += l->right->lines;
+    l->bytes += l->right->bytes;
+  }
+}
+
+size_t internal_scan(Line *l, size_t from, int characters) {
+  size_t i;
+  size_t k;
+  size_t bytes = 0;
+
+  for (i = 0; i < l->pieces_count; i++) {
+    const Piece *p      = &l->pieces[i];
+    size_t       start  = 0;
+    int          counted;
+
+    if (bytes + p->length <= from) {
+      bytes += p->length;
+      continue;
+    }
+
+    if (from > bytes)
+      start = from - bytes;
+
+    // Skip whole spans while the target character is beyond them
+    counted = utf8_ncharacters((p->c + start), (p->length - start));
+    if (counted <= characters) {
+      characters -= counted;
+      bytes += p->length;
+      continue;
+    }
+
+    for (k = start; k < p->length; k++) {
+      if ((p->c[k] & 0xC0) != 0x80 && characters-- == 0)
+        return bytes + k;
+    }
+
+    bytes += p->length;
+  }
+
+  return (size_t)l->length;
+}
+
+int internal_count(Line *l, size_t from, size_t to) {
+  size_t i;
+  size_t bytes      = 0;
+  int    characters = 0;
+
+  for (i = 0; i < l->pieces_count && bytes < to; i++) {
+    const Piece *p     = &l->pieces[i];
+    size_t       start = (from > bytes ? from - bytes : 0);
+    size_t       end   = (to - bytes < p->length ? to - bytes : p->length);
+
+    if (start < end)
+      characters += utf8_ncharacters((p->c + start), (end - start));
+
+    bytes += p->length;
+  }
+
+  return characters;
+}
+
+int internal_cells(Line *l, size_t from, size_t to) {
+  size_t i;
+  size_t bytes = 0;
+  int    cells = 0;
+
+  for (i = 0; i < l->pieces_count && bytes < to; i++) {
+    const Piece *p     = &l->pieces[i];
+    size_t       start = (from > bytes ? from - bytes : 0);
+    size_t       end   = (to - bytes < p->length ? to - bytes : p->length);
+
+    if (start < end)
+      cells += utf8_ncells((p->c + start), (end - start));
+
+    bytes += p->length;
+  }
+
+  return cells;
+}
+
+int internal_advance(Line *l, size_t from, int column, int target) {
+  size_t i;
+  size_t k;
+  size_t bytes      = 0;
+  int    characters = 0;
+
+  for (i = 0; i < l->pieces_count; i++) {
+    const Piece *p = &l->pieces[i];
+
+    if (bytes + p->length <= from) {
+      bytes += p->length;
+      continue;
+    }
+
+    // Characters never straddle pieces
+    for (k = (from > bytes ? from - bytes : 0); k < p->length; characters++) {
+      size_t n = utf8_width(p->c[k]);
+
+      if (k + n > p->length)
+        n = p->length - k;
+
+      column += utf8_ncells((p->c + k), n);
+      if (column > target)
+        return characters;
+
+      k += n;
+    }
+
+    bytes += p->length;
+  }
+
+  return characters;
+}
+
+Checkpoints *internal_checkpoints(Line *l, size_t count, size_t at) {
+  Checkpoints *cp = l->checkpoints;
+
+  if (cp == NULL) {
+    cp = (Checkpoints *)safe_malloc(sizeof(Checkpoints) + (4 * sizeof(Checkpoint)));
+    cp->count = 1;
+    cp->capacity = 4;
+    cp->points[0].offset = 0;
+    cp->points[0].column = 0;
+    l->checkpoints = cp;
+  }
+
+  // Extend until there are enough, the last one passes `at`, or the line ends
+  while (cp->count < count && cp->points[cp->count - 1].offset <= at) {
+    Checkpoint *last = &cp->points[cp->count - 1];
+    size_t      next = internal_scan(l, last->offset, CHECKSIZ);
+    int         column;
+
+    if (next >= (size_t)l->length)
+      break;
+
+    // ASCII spans take a cell a character, no need to decode them
+    column = last->column + ((next - last->offset) == CHECKSIZ ? CHECKSIZ : internal_cells(l, last->offset, next));
+
+    if (cp->count == cp->capacity) {
+      cp->capacity *= 2;
+      cp = (Checkpoints *)safe_realloc(cp, sizeof(Checkpoints) + (cp->capacity * sizeof(Checkpoint)));
+      l->checkpoints = cp;
+    }
+
+    cp->points[cp->count].offset = next;
+    cp->points[cp->count++].column = column;
+  }
+
+  return cp;
+}
+
+void internal_unlex(Buffer *b, Line *l) {
+  l->lexed = false;
+
+  if (b->unlexed != l && (b->unlexed == NULL || line_number(l) < line_number(b->unlexed)))
+    b->unlexed = l;
+}
+
+void internal_invalidate(Line *l, size_t at) {
+  Checkpoints *cp = l->checkpoints;
+
+  // Characters before the edit keep their offsets
+  if (cp != NULL) {
+    while (cp->count > 1 && cp->points[cp->count - 1].offset > at)
+      cp->count--;
+  }
+}
@@ -0,0 +1,611 @@
+#ifndef BUFFER_H
+#define BUFFER_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define ADDSIZ     65536          // Minimum size of an add buffer block
+#define POOLSIZ    1048576        // Size of a slab block for lines and piece lists
+#define PIECES_MAX 32             // Pieces in a line before it is compacted
+#define SPLITSIZ   256            // Lines materialised from the original buffer at a time
+#define LOADSIZ    65536          // Largest batch of lines split by the loader thread
+#define CHECKSIZ   256            // Characters between checkpoints of a long line
+#define CHECKMIN   1024           // Bytes before a line is long enough for checkpoints
+#define PIECES_CLASSES 8          // Piece list size classes (1, 2, 4 ... 128 pieces)
+#define PIECES_LARGEST (1 << (PIECES_CLASSES - 1)) // Pieces in a list of the largest class
+#define IOVSIZ     1024           // Spans written per writev when saving
+#define COPYMIN    65536          // Unchanged original spans copied in-kernel from this size
+#define UNDOSIZ    67108864       // Default memory budget of the undo journal
+#define SEARCHMAX  256            // Longest search pattern in bytes
+#define SWAPSIZ    65536          // Swap journal bytes queued before a commit is forced
+#define SWAPTICK   500            // Milliseconds a swap journal record waits for more to commit with
+#define BOM        "\xEF\xBB\xBF"  // UTF-8 byte order mark
+
+/* Types */
+typedef struct Piece {
+  const char *c;                  // Start of span (original or add buffer)
+  size_t      length;             // Span length in bytes
+} Piece;
+
+typedef struct Block Block;
+struct Block {
+  Block  *prev;                   // Previously filled block
+  size_t  used;                   // Bytes used
+  size_t  capacity;               // Bytes available
+  char    c[];                    // Content
+};
+
+typedef struct Checkpoint {
+  size_t offset;                  // Byte offset
+  int    column;                  // Display column
+} Checkpoint;
+
+typedef struct Checkpoints {
+  size_t     count;               // Checkpoints still valid
+  size_t     capacity;            // Checkpoints allocated
+  Checkpoint points[];            // Where every CHECKSIZ-th character is
+} Checkpoints;
+
+typedef struct Loader Loader;     // Background splitting state (buffer.c)
+typedef struct Swap Swap;         // Swap journal writer state (buffer.c)
+
+typedef struct Line Line;
+struct Line {
+  Piece *pieces;                  // Line content, as spans in order
+  size_t pieces_count;            // Pieces used
+  size_t pieces_capacity;         // Pieces allocated
+  int    length;                  // Line length in bytes
+  int    visual_length;           // Line "character" count
+  int    width;                   // Display width in terminal cells, -1 until needed
+  Checkpoints *checkpoints;       // Character to byte index, long lines only
+  bool   dirty;                   // Needs a repaint?
+  bool   lexed;                   // Highlighter states are up to date with the content
+  unsigned char syntax_in;        // Highlighter state at the start of the line, when lexed
+  unsigned char syntax_out;       // Highlighter state at the end of the line, when lexed
+  Line  *prev;                    // Previous line
+  Line  *next;                    // Next line
+  Line  *parent;                  // Line index: parent node
+  Line  *left;                    // Line index: lines before, in subtree
+  Line  *right;                   // Line index: lines after, in subtree
+  unsigned int priority;          // Line index: heap priority (treap)
+  size_t lines;                   // Line index: lines in subtree
+  size_t bytes;                   // Line index: bytes in subtree, counting line breaks
+};
+
+typedef struct Position {
+  int   offset;                   // Offset in line
+  Line *line;                     // Line of position
+} Position;
+
+typedef struct Selection {
+  Position *start;
+  Position *end;
+} Selection;
+
+typedef struct Change {
+  size_t       offset;            // Byte offset in the buffer
+  const char  *c;                 // Text inserted (in the add buffer) or removed (owned copy)
+  size_t       length;            // Text length in bytes
+  size_t       capacity;          // Bytes allocated for removed text, 0 for insertions
+  unsigned int group;             // Changes undone together share a group
+  bool         insert;            // Insertion or removal?
+} Change;
+
+typedef struct Journal {
+  Change      *changes;           // Changes, oldest first
+  size_t       first;             // First change kept, older ones were dropped
+  size_t       current;           // End of applied changes, the ones after can be redone
+  size_t       count;             // End of changes
+  size_t       capacity;          // Changes allocated
+  size_t       size;              // Memory held in bytes
+  size_t       budget;            // Memory limit, oldest changes are dropped past it
+  unsigned int group;             // Group of the latest change
+  bool         sealed;            // Next change starts a new group
+} Journal;
+
+typedef struct Search {
+  char    pattern[SEARCHMAX];     // Pattern, line breaks in it match across lines
+  size_t  length;                 // Pattern length in bytes
+  size_t  newline;                // Offset of the first line break in the pattern (or length)
+  size_t  skip[256];              // Horspool shift for each byte under the end (or start, backward) of the window
+  bool    backward;               // Search towards the start of the buffer
+  Line   *origin;                 // Line the search started from
+  size_t  origin_at;              // Byte offset the search started from
+  Line   *line;                   // Line to scan next
+  size_t  at;                     // Offset in that line to resume from (or stop at, backward)
+  bool    wrapped;                // Went past the end (or start) of the buffer
+  bool    done;                   // Found a match or scanned the whole buffer
+  Line   *match;                  // Line of the match, NULL if there is none (yet)
+  size_t  match_at;               // Byte offset of the match
+} Search;
+
+typedef struct Buffer {
+  Position *cursor;               // Position in buffer
+  int       offset_prev;          // Previous cursor offset, used for maintaining column on vertical movement
+  char     *filename;             // Filename
+  Line     *first_line;           // First line of file
+  Line     *last_line;            // Last line of file
+  Line     *top;                  // First line in view
+  int       left;                 // First column in view (of the top line, when wrapping)
+  Line     *root;                 // Root of the line index
+  char     *original;             // Original (read-only) file content
+  size_t    original_length;      // Original content length in bytes
+  size_t    original_split;       // Bytes of original already split into lines
+  size_t    file_length;          // Bytes of the file held, the original and whole lines followed since
+  bool      original_mapped;      // Original is a read-only file mapping
+  int       original_fd;          // File mapped as original, source of in-kernel copies (or -1)
+  bool      eol;                  // Last line ends with a line break
+  bool      crlf;                 // First break is CR LF: CRs before breaks stay out of lines, new breaks get one
+  bool      bom;                  // Original starts with a UTF-8 byte order mark, kept out of the first line
+  Block    *add;                  // Append-only add buffer, newest block first
+  Block    *pool;                 // Slabs for lines and piece lists, newest block first
+  Line     *lines_free;           // Released lines, linked through next
+  Piece    *pieces_free[PIECES_CLASSES]; // Released piece lists, by size class
+  char     *scratch;              // Scratch space for temporaries
+  size_t    scratch_capacity;     // Scratch space allocated
+  Loader   *loader;               // Loader thread splitting the original, while it runs
+  uint64_t  split_ns;             // Time the loader thread took to split the original
+  Journal   journal;              // Undo and redo history
+  Swap     *swap;                 // Swap journal of changes since the file was saved, if any
+  bool      dirty;                // Changed since it was loaded or saved
+  Line     *unlexed;              // First line the highlighter has to look at again (NULL if none)
+  Position *cursors;              // Extra cursors, in document order
+  size_t    cursors_count;        // Extra cursors in use
+  size_t    cursors_capacity;     // Extra cursors allocated
+} Buffer;
+
+/**
+ * Create an empty buffer with a single empty line.
+ *
+ * @return [Buffer *] New buffer, cursor at the start of the first line
+ */
+Buffer *buffer_new(void);
+
+/**
+ * Free a buffer, its lines and its storage.
+ *
+ * @param b [Buffer *] Buffer to free
+ */
+void buffer_free(Buffer *b);
+
+/**
+ * Attach file content as the original buffer. Only the first line is created,
+ * the rest is split into lines on demand by `buffer_split`. A UTF-8 byte order
+ * mark, and the carriage returns of CR LF line breaks when the first break is
+ * one, are kept out of the lines and written back by `buffer_save`. Lines that
+ * end in a lone LF among them keep it.
+ *
+ * @param b [Buffer *] Empty buffer to attach to
+ * @param original [char *] File content (owned by the buffer from now on)
+ * @param length [size_t] Content length in bytes
+ * @param fd [int] File content is a mapping of (`munmap`, the file is closed
+ *   with the buffer), or -1 for heap content (`free`)
+ */
+void buffer_attach(Buffer *b, char *original, size_t length, int fd);
+
+/**
+ * Materialise lines from the part of the original buffer not yet split,
+ * appending them after the last line. Lines reference the original buffer.
+ *
+ * @param b [Buffer *] Buffer to split
+ * @param count [size_t] Maximum number of lines to create
+ *
+ * @return [size_t] Number of lines created
+ */
+size_t buffer_split(Buffer *b, size_t count);
+
+/**
+ * Start splitting the rest of the original buffer on a worker thread. The
+ * worker builds detached batches of lines and never touches the buffer, so
+ * lines only join it in `buffer_load_poll`, on the caller's thread, between
+ * edits. Until then `buffer_split` waits for the worker instead of splitting.
+ *
+ * @param b [Buffer *] Buffer with an attached original
+ */
+void buffer_load(Buffer *b);
+
+/**
+ * Append the batches the loader has finished since the last call, and join the
+ * loader once it is done.
+ *
+ * @param b [Buffer *] Buffer being loaded
+ *
+ * @return [bool] True while the loader is still running
+ */
+bool buffer_load_poll(Buffer *b);
+
+/**
+ * Append the whole lines a file has grown by since it was attached (or last
+ * followed), reading only the new bytes into the add buffer. A trailing line
+ * without a line break is left for a later call. The buffer is expected to
+ * hold the file unchanged, and nothing is journaled for undo. Does nothing
+ * until the original is fully split.
+ *
+ * @param b [Buffer *] Buffer holding the file
+ * @param fd [int] The file, open for reading
+ * @param length [size_t] Its current length, at least `file_length`
+ *
+ * @return [long] Bytes appended, or -1 with `errno` set
+ */
+long buffer_follow(Buffer *b, int fd, size_t length);
+
+/**
+ * Whether part of the original buffer has not been split into lines yet.
+ *
+ * @param b [Buffer *] Buffer to check
+ *
+ * @return [bool] True if more lines may follow `last_line`
+ */
+bool buffer_partial(Buffer *b);
+
+/**
+ * Save the buffer to its file. Lines are streamed to a temporary file next to
+ * it with `writev`, spans that are still contiguous in the original buffer are
+ * merged (and copied with `copy_file_range` from the mapped file where
+ * available), then the temporary file replaces the original with `rename`.
+ * Symbolic links are followed to the file they point to, and a file with
+ * other hard links is rewritten in place from the temporary file instead, so
+ * that every link sees the new content.
+ *
+ * @param b [Buffer *] Buffer to save (must have a filename)
+ * @param sync [bool] Whether to `fsync` before replacing the file
+ *
+ * @return [int] 0 on success, or -1 with `errno` set
+ */
+int buffer_save(Buffer *b, bool sync);
+
+/**
+ * Start journaling changes to a swap file next to the buffer's file, so they
+ * survive a crash. Records are queued in memory and a writer thread commits
+ * them together, with one `write` and one `fsync`, once SWAPSIZ bytes are
+ * queued or SWAPTICK milliseconds after the first one. A swap file left for
+ * the same version of the file (size, modification time and inode) is replayed
+ * first, without going through the undo journal. Saving starts a new swap file,
+ * freeing the buffer removes it. The swap file is locked while open, a swap
+ * file locked by another session is left alone.
+ *
+ * @param b [Buffer *] Loaded buffer (with a filename)
+ *
+ * @return [long] Number of changes replayed, or -1 with `errno` set
+ *   (`EWOULDBLOCK` when another session holds the swap file)
+ */
+long buffer_swap_open(Buffer *b);
+
+/**
+ * Insert text at a byte offset of a line, splitting it at line breaks. The text
+ * is copied once to the add buffer and journaled for undo, coalescing with the
+ * previous insertion when it directly follows it and the journal is not sealed.
+ *
+ * @param b [Buffer *] Buffer to insert into
+ * @param l [Line *] Line to insert into
+ * @param at [size_t *] Byte offset in line, set to the end of the text
+ * @param c [const char *] Text to insert
+ * @param size [size_t] Text length in bytes
+ *
+ * @return [Line *] Line holding the end of the text
+ */
+Line *buffer_insert(Buffer *b, Line *l, size_t *at, const char *c, size_t size);
+
+/**
+ * Add an extra cursor, kept in document order with the others. Any change but
+ * `buffer_insert_cursors` drops the extra cursors.
+ *
+ * @param b [Buffer *] Buffer
+ * @param l [Line *] Line of the cursor
+ * @param offset [int] Character offset in line
+ *
+ * @return [bool] False if there already is an extra cursor there
+ */
+bool buffer_cursor_add(Buffer *b, Line *l, int offset);
+
+/**
+ * Find where a position goes among the extra cursors.
+ *
+ * @param b [Buffer *] Buffer
+ * @param l [Line *] Line of the position
+ * @param offset [int] Character offset in line
+ *
+ * @return [size_t] Index of the first extra cursor not before the position
+ */
+size_t buffer_cursor_find(Buffer *b, Line *l, int offset);
+
+/**
+ * Insert text at the cursor and at every extra cursor in one pass over them in
+ * document order. The text is copied once to the add buffer and shared by all
+ * insertions, which are undone together as a single group. Every cursor ends
+ * up after its copy of the text.
+ *
+ * @param b [Buffer *] Buffer to insert into
+ * @param c [const char *] Text to insert
+ * @param size [size_t] Text length in bytes
+ */
+void buffer_insert_cursors(Buffer *b, const char *c, size_t size);
+
+/**
+ * Remove bytes from a byte offset of a line, joining lines across line
+ * breaks. The removed text is journaled for undo, coalescing like
+ * `buffer_insert` for repeated deletions at, or just before, the same offset.
+ *
+ * @param b [Buffer *] Buffer to remove from
+ * @param l [Line *] Line to remove from
+ * @param at [size_t] Byte offset in line
+ * @param size [size_t] Bytes to remove, line breaks count as one
+ *
+ * @return [size_t] Bytes removed (less than `size` at the end of the buffer)
+ */
+size_t buffer_delete(Buffer *b, Line *l, size_t at, size_t size);
+
+/**
+ * End the current undo group, so the next change is undone on its own.
+ *
+ * @param b [Buffer *] Buffer
+ */
+void buffer_seal(Buffer *b);
+
+/**
+ * Revert the latest group of changes. Each change is reverted in one step,
+ * whatever its size.
+ *
+ * @param b [Buffer *] Buffer
+ * @param l [Line **] Set to the line where the group started
+ * @param at [size_t *] Set to the byte offset in that line
+ *
+ * @return [bool] False if there was nothing to undo
+ */
+bool buffer_undo(Buffer *b, Line **l, size_t *at);
+
+/**
+ * Apply again the latest group of changes reverted by `buffer_undo`. Any new
+ * change drops the groups that could be redone.
+ *
+ * @param b [Buffer *] Buffer
+ * @param l [Line **] Set to the line where the group started
+ * @param at [size_t *] Set to the byte offset in that line
+ *
+ * @return [bool] False if there was nothing to redo
+ */
+bool buffer_redo(Buffer *b, Line **l, size_t *at);
+
+/**
+ * Start searching for a pattern from a byte offset of a line, wrapping around
+ * the ends of the buffer. Only matches starting after (or, backward, before) the
+ * offset are found before wrapping. Nothing is scanned until
+ * `buffer_search_step`.
+ *
+ * @param b [Buffer *] Buffer to search
+ * @param s [Search *] Search to start
+ * @param pattern [const char *] Pattern, matched byte for byte
+ * @param length [size_t] Pattern length in bytes (truncated to SEARCHMAX)
+ * @param backward [bool] Search towards the start of the buffer
+ * @param l [Line *] Line to start from
+ * @param at [size_t] Byte offset in line
+ */
+void buffer_search_start(Buffer *b, Search *s, const char *pattern, size_t length, bool backward, Line *l, size_t at);
+
+/**
+ * Continue a search for about `budget` bytes, whole lines at a time. Lines are
+ * skimmed with `memchr` for the first byte of the pattern and Horspool shifts,
+ * a pattern with line breaks is only checked where it can cross lines.
+ *
+ * @param b [Buffer *] Buffer being searched
+ * @param s [Search *] Search to continue
+ * @param budget [size_t] Bytes to scan before returning
+ *
+ * @return [bool] True while the search is still going, `s->match` is set once
+ *   it is done if there was a match
+ */
+bool buffer_search_step(Buffer *b, Search *s, size_t budget);
+
+/**
+ * Get the heap memory held by a buffer: lines, piece lists, add buffer, undo
+ * journal and scratch space. A mapped original is not counted.
+ *
+ * @param b [Buffer *] Buffer
+ *
+ * @return [size_t] Footprint in bytes
+ */
+size_t buffer_memory(Buffer *b);
+
+/**
+ * Get the number of lines split so far.
+ *
+ * @param b [Buffer *] Buffer
+ *
+ * @return [size_t] Line count
+ */
+size_t buffer_lines(Buffer *b);
+
+/**
+ * Find a line by number in O(log n).
+ *
+ * @param b [Buffer *] Buffer
+ * @param number [size_t] Line number, starting at 1 (clamped to the buffer)
+ *
+ * @return [Line *] Line
+ */
+Line *buffer_line(Buffer *b, size_t number);
+
+/**
+ * Copy bytes to the end of the add buffer. The copy never moves, so pieces may
+ * reference it for the lifetime of the buffer.
+ *
+ * @param b [Buffer *] Buffer owning the add buffer
+ * @param c [const char *] Bytes to copy
+ * @param size [size_t] Number of bytes
+ *
+ * @return [const char *] Stable pointer to the copy
+ */
+const char *buffer_append(Buffer *b, const char *c, size_t size);
+
+/**
+ * Get scratch space for a temporary. The space is reused by the next call, so
+ * it must not be held across calls, but growing it keeps its contents.
+ *
+ * @param b [Buffer *] Buffer owning the scratch space
+ * @param size [size_t] Bytes needed
+ *
+ * @return [void *] Scratch space of at least `size` bytes
+ */
+void *buffer_scratch(Buffer *b, size_t size);
+
+/**
+ * Allocate an empty, dirty line from the buffer's slabs, not yet linked in.
+ *
+ * @param b [Buffer *] Buffer to allocate from
+ *
+ * @return [Line *] New line
+ */
+Line *line_new(Buffer *b);
+
+/**
+ * Release a line and its piece list (not the text it references) back to the
+ * buffer's slabs.
+ *
+ * @param b [Buffer *] Buffer the line was allocated from
+ * @param l [Line *] Line to free
+ */
+void line_free(Buffer *b, Line *l);
+
+/**
+ * Get the line after a line, materialising more lines when reaching the end of
+ * what has been split so far.
+ *
+ * @param b [Buffer *] Buffer owning the line
+ * @param l [Line *] Line
+ *
+ * @return [Line *] Next line, or NULL at the end of the buffer
+ */
+Line *line_next(Buffer *b, Line *l);
+
+/**
+ * Get the number of a line in O(log n).
+ *
+ * @param l [Line *] Line
+ *
+ * @return [size_t] Line number, starting at 1
+ */
+size_t line_number(Line *l);
+
+/**
+ * Get the byte offset of the start of a line in O(log n).
+ *
+ * @param l [Line *] Line
+ *
+ * @return [size_t] Offset of the line from the start of the buffer
+ */
+size_t line_offset(Line *l);
+
+/**
+ * Insert a stable span at a byte offset of a line. Extends the neighbouring
+ * piece when the span directly follows it in memory, otherwise splits.
+ *
+ * @param b [Buffer *] Buffer owning the line (used for compaction)
+ * @param l [Line *] Line to insert into
+ * @param at [size_t] Byte offset in line
+ * @param c [const char *] Span (must outlive the buffer, see `buffer_append`)
+ * @param size [size_t] Span length in bytes
+ *
+ * @return [int] Number of characters inserted
+ */
+int line_insert(Buffer *b, Line *l, size_t at, const char *c, size_t size);
+
+/**
+ * Remove a byte range from a line.
+ *
+ * @param b [Buffer *] Buffer owning the line
+ * @param l [Line *] Line to remove from
+ * @param at [size_t] Byte offset in line
+ * @param size [size_t] Number of bytes to remove
+ */
+void line_delete(Buffer *b, Line *l, size_t at, size_t size);
+
+/**
+ * Split a line in two at a byte offset, linking the new line after it. Only
+ * pieces move, no text is copied.
+ *
+ * @param b [Buffer *] Buffer owning the line
+ * @param l [Line *] Line to split
+ * @param at [size_t] Byte offset in line
+ *
+ * @return [Line *] The new line holding the tail
+ */
+Line *line_split(Buffer *b, Line *l, size_t at);
+
+/**
+ * Join the following line onto the end of a line and free it.
+ *
+ * @param b [Buffer *] Buffer owning the line
+ * @param l [Line *] Line to join onto (must have a next line)
+ */
+void line_join(Buffer *b, Line *l);
+
+/**
+ * Copy bytes of a line into a flat buffer.
+ *
+ * @param l [Line *] Line to copy from
+ * @param at [size_t] Byte offset in line
+ * @param dest [char *] Destination
+ * @param size [size_t] Maximum number of bytes to copy
+ *
+ * @return [size_t] Number of bytes copied
+ */
+size_t line_copy(Line *l, size_t at, char *dest, size_t size);
+
+/**
+ * Convert a character offset in a line to a byte offset. Long lines keep
+ * checkpoints every CHECKSIZ characters, so at most CHECKSIZ characters are
+ * scanned once the checkpoints up to the offset exist.
+ *
+ * @param l [Line *] Line
+ * @param offset [int] Character offset (clamped to the line)
+ *
+ * @return [size_t] Byte offset
+ */
+size_t line_byte_offset(Line *l, int offset);
+
+/**
+ * Get the display width of a line in terminal cells. Worked out on first use,
+ * then kept up to date by edits.
+ *
+ * @param l [Line *] Line
+ *
+ * @return [int] Width in cells
+ */
+int line_width(Line *l);
+
+/**
+ * Convert a character offset in a line to the display column it starts at,
+ * scanning at most CHECKSIZ characters from the nearest checkpoint.
+ *
+ * @param l [Line *] Line
+ * @param offset [int] Character offset (clamped to the line)
+ *
+ * @return [int] Display column
+ */
+int line_column(Line *l, int offset);
+
+/**
+ * Find the character covering a display column, the inverse of
+ * `line_column`.
+ *
+ * @param l [Line *] Line
+ * @param column [int] Display column
+ *
+ * @return [int] Character offset (the character count past the end of the line)
+ */
+int line_column_offset(Line *l, int column);
+
+/**
+ * Convert a byte offset in a line to a character offset, using the same
+ * checkpoints as `line_byte_offset`.
+ *
+ * @param l [Line *] Line
+ * @param at [size_t] Byte offset (clamped to the line)
+ *
+ * @return [int] Character offset
+ */
+int line_char_offset(Line *l, size_t at);
+
+#endif
@@ -10,13 +10,13 @@ bool _mv_nextchar_md_ins(Buffer *b, Selection *s) {
 bool _mv_eol_md_ins(Buffer *b, Selection *s) {
   action_move_eol(b, s);
   action_mode_insert(b, s);
-  return true;
+  return false;
 }
 
 bool _mv_bol_md_ins(Buffer *b, Selection *s) {
   action_move_bol(b, s);
   action_mode_insert(b, s);
-  return true;
+  return false;
 }
 
 bool _in_line_md_ins(Buffer *b, Selection *s) {
@@ -25,10 +25,40 @@ bool _in_line_md_ins(Buffer *b, Selection *s) {
   return false;
 }
 
+/* Settings */
+static const bool   save_fsync   = true;     // Flush saved files to disk before replacing the original
+static const bool   swap_journal = true;     // Journal unsaved changes next to the file, replayed after a crash
+static const size_t undo_budget  = 67108864; // Memory kept for undo per buffer, oldest changes go first
+static const char  *stats_file   = NULL;     // File the performance counters are written to on exit (or NULL)
+static const bool   soft_wrap    = false;    // Wrap long lines onto following rows instead of scrolling sideways
+static const size_t memory_limit = 1073741824; // Memory of loaded buffers before unchanged ones are unloaded, least recently viewed first
+static const bool   syntax_highlight = true; // Highlight files with one of `syntax_extensions`
+static const bool   sync_updates = true; // Wrap each changed frame in synchronized update markers (ignored by terminals without them)
+
+/* Syntax highlighting */
+static const char *syntax_extensions[] = { ".c", ".h", ".cc", ".cpp", ".hpp", NULL };
+
+static const short syntax_colors[CLASSES] = {
+  [Class_text]      = -1,         // Terminal default
+  [Class_keyword]   = COLOR_YELLOW,
+  [Class_type]      = COLOR_GREEN,
+  [Class_number]    = COLOR_MAGENTA,
+  [Class_string]    = COLOR_RED,
+  [Class_comment]   = COLOR_BLUE,
+  [Class_directive] = COLOR_CYAN
+};
+
 /* Key mappings */
 static const KeyMapping key_maps[] = {
   // Misc.
   { .mode = Mode_normal, .operator = "q",    .action = action_quit },
+  { .mode = Mode_normal, .operator = "\x13", .action = action_save }, // ^S
+  { .mode = Mode_insert, .operator = "\x13", .action = action_save }, // ^S
+  { .mode = Mode_normal, .operator = "\x07", .action = action_stats }, // ^G
+  { .mode = Mode_normal, .operator = "\x17", .action = action_wrap }, // ^W
+  { .mode = Mode_normal, .operator = "F",    .action = action_follow },
+  { .mode = Mode_normal, .operator = "]b",   .action = action_buffer_next },
+  { .mode = Mode_normal, .operator = "[b",   .action = action_buffer_prev },
   { .mode = Mode_normal, .operator = "i",    .action = action_mode_insert },
   { .mode = Mode_insert, .operator = "\033", .action = action_mode_normal },
 
@@ -39,7 +69,8 @@ static const KeyMapping key_maps[] = {
   { .mode = Mode_normal, .operator = "l",    .action = action_move_nextchar },
   { .mode = Mode_normal, .operator = "H",    .action = action_move_bof },
   { .mode = Mode_normal, .operator = "L",    .action = action_move_eof },
-  { .mode = Mode_normal, .operator = "G",    .action = action_move_eof },
+  { .mode = Mode_normal, .operator = "G",    .action = action_move_eof, .counted = true },
+  { .mode = Mode_normal, .operator = "gg",   .action = action_move_bof, .counted = true },
   { .mode = Mode_normal, .operator = "0",    .action = action_move_bol },
   { .mode = Mode_normal, .operator = "$",    .action = action_move_eol },
 
@@ -50,4 +81,26 @@ static const KeyMapping key_maps[] = {
 
   // Insertion + action
   { .mode = Mode_normal, .operator = "o",    .action = _in_line_md_ins },
+
+  // Deletion
+  { .mode = Mode_normal, .operator = "x",    .action = action_delete_char },
+  { .mode = Mode_normal, .operator = "dd",   .action = action_delete_line },
+
+  // History
+  { .mode = Mode_normal, .operator = "u",    .action = action_undo },
+  { .mode = Mode_normal, .operator = "\x12", .action = action_redo }, // ^R
+
+  // Cursors
+  { .mode = Mode_normal, .operator = "+",    .action = action_cursor_add },
+  { .mode = Mode_normal, .operator = "\033", .action = action_cursor_clear },
+
+  // Search
+  { .mode = Mode_normal, .operator = "/",    .action = action_search_forward },
+  { .mode = Mode_normal, .operator = "?",    .action = action_search_backward },
+  { .mode = Mode_normal, .operator = "n",    .action = action_search_next },
+  { .mode = Mode_normal, .operator = "N",    .action = action_search_prev },
+  { .mode = Mode_search, .operator = "\n",   .action = action_search_accept },
+  { .mode = Mode_search, .operator = "\033", .action = action_search_cancel },
+  { .mode = Mode_search, .operator = "\x7f", .action = action_search_erase }, // Backspace
+  { .mode = Mode_search, .operator = "\x08", .action = action_search_erase }, // ^H
 };
@@ -0,0 +1,56 @@
+#define _POSIX_C_SOURCE 200809L // strdup
+
+#include "safe.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+atomic_size_t safe_allocations;
+
+#define COUNT() atomic_fetch_add_explicit(&safe_allocations, 1, memory_order_relaxed)
+
+void *safe_calloc(size_t nmemb, size_t size) {
+  void *ptr;
+
+  if ((ptr = calloc(nmemb, size)) == NULL)
+    err(errno, "Unable to allocate memory (calloc)");
+
+  COUNT();
+
+  return ptr;
+}
+
+void *safe_malloc(size_t size) {
+  void *ptr;
+
+  if ((ptr = malloc(size)) == NULL)
+    err(errno, "Unable to allocate memory (malloc)");
+
+  COUNT();
+
+  return ptr;
+}
+
+void *safe_realloc(void *ptr, size_t size) {
+  void *new_ptr;
+
+  if ((new_ptr = realloc(ptr, size)) == NULL)
+    err(errno, "Unable to allocate memory (realloc)");
+
+  COUNT();
+
+  return new_ptr;
+}
+
+char *safe_strdup(const char *s) {
+  char *ptr;
+
+  if ((ptr = strdup(s)) == NULL)
+    err(errno, "Unable to duplicate string");
+
+  COUNT();
+
+  return ptr;
+}
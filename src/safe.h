@@ -0,0 +1,48 @@
+#ifndef SAFE_H
+#define SAFE_H 1
+
+#include <stddef.h>
+
+#include <stdatomic.h>
+
+extern atomic_size_t safe_allocations; // Allocations made so far, from any thread
+
+/**
+ * Allocate zeroed memory, exiting on failure.
+ *
+ * @param nmemb [size_t] Number of members
+ * @param size [size_t] Size of each member
+ *
+ * @return [void *] Pointer to the allocated memory
+ */
+void *safe_calloc(size_t nmemb, size_t size);
+
+/**
+ * Allocate memory, exiting on failure.
+ *
+ * @param size [size_t] Size in bytes
+ *
+ * @return [void *] Pointer to the allocated memory
+ */
+void *safe_malloc(size_t size);
+
+/**
+ * Resize memory, exiting on failure.
+ *
+ * @param ptr [void *] Memory to resize (or NULL)
+ * @param size [size_t] New size in bytes
+ *
+ * @return [void *] Pointer to the resized memory
+ */
+void *safe_realloc(void *ptr, size_t size);
+
+/**
+ * Duplicate a string, exiting on failure.
+ *
+ * @param s [const char *] NULL-terminated string to duplicate
+ *
+ * @return [char *] Pointer to the copy
+ */
+char *safe_strdup(const char *s);
+
+#endif
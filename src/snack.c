@@ -1,368 +1,1470 @@
 #define _XOPEN_SOURCE_EXTENDED 1
+#define _POSIX_C_SOURCE 200809L // clock_gettime
 
 #include "snack.h"
 #include "config.h"
 
 /* Internal functions */
+static uint64_t internal_clock();                  // Monotonic time in ns
 static bool internal_command();                    // Command processing
+static void internal_keymap();                     // Compile key mappings into tries
 static void internal_edit();                       // Main edit loop
 static void internal_exit();                       // Gracefully exit
+static int  internal_input(char *c);               // Read a key from the terminal or the replay, recording it
+static void internal_options(int argc, char *argv[]); // Parse command line options
+static void internal_replay_report();              // Print replay timings
 static void internal_loadfile(Buffer *buffer);     // Load file
+static void internal_open(const char *filename);   // Add a file to the buffer list, loaded once viewed
+static void internal_switch(size_t index);         // View a buffer of the list, loading it if needed
+static void internal_unload(Entry *e);             // Drop a buffer's content, keeping its file and view
+static void internal_evict();                      // Unload unchanged buffers while over `memory_limit`
+static void internal_recover(Buffer *buffer);      // Replay and keep journaling changes in the swap file
 static void internal_paint();                      // Repaint screen
-static void internal_setup();                      // Setup editor
+static void internal_paste();                      // Insert a bracketed paste in one go
+static size_t internal_repair(const char *c, size_t size, char *dest); // Copy text, replacing malformed bytes
+static void internal_paint_line(Line *l, int column, int row); // Repaint a single editor row
+static void internal_view(int rows_visible, int cols_visible, int x); // Keep the cursor (at column x) in view, scrolling sideways
+static void internal_view_wrap(int rows_visible, int cols_visible, int x); // Keep the cursor (at column x) in view, wrapping lines
+static void internal_scroll(long lines);           // Move the viewport, shifting painted rows
+static bool internal_highlighted(Buffer *b);       // Whether a buffer is highlighted
+static bool internal_highlight(size_t budget);     // Bring highlighter states up to date down to the view
+static void internal_follow_start();               // Follow the current buffer's file as it grows
+static void internal_follow_stop();                // Stop following
+static bool internal_follow();                     // Catch up with the followed file, whether still following
+static void internal_follow_wait(int timeout);     // Sleep until input arrives or the followed file changes
+static void internal_search_start();               // Restart the search for the prompt from where it began
+static bool internal_search(size_t budget);        // Continue the search, moving the cursor once it is done
+static bool internal_search_again(bool backward);  // Search the last pattern again from the cursor
+static void internal_setup();                      // Setup editor, without a terminal
+static void internal_stats(uint64_t start, size_t written); // Account for a painted frame
+static void internal_stats_dump();                 // Write the counter totals to `stats_file`
+static void internal_loaded();                     // Report how fast the current buffer loaded
+static size_t internal_written();                  // Bytes written by the process so far
 static void internal_term();                       // Initialize terminal
-static Position *internal_insert(Position *p, char *c, size_t size); // Parse and insert data at position
-
-/* Safe memory function wrappers */
-static void *safe_calloc(size_t nmemb, size_t size);
-static void *safe_malloc(size_t size);
-static void *safe_realloc(void *ptr, size_t size);
-static char *safe_strdup(const char *s);
+static void internal_insert(Position *p, char *c, size_t size);     // Parse and insert data at position, moving it past the data
+static void internal_insert_all(char *c, size_t size);              // Insert data at the cursor and every extra cursor
+static void internal_delete(Position *p, int characters);            // Delete characters at position
 
 /* Go go go */
+#ifndef BENCH
 int main(int argc, char *argv[]) {
   setlocale(LC_ALL, "");
 
   internal_setup();
+  internal_options(argc, argv);
 
-  // TMP
-  if (argc > 1)
-    current_buffer->filename = safe_strdup(argv[1]);
+  // A replay without painting needs no terminal
+  if (replay_file == NULL || replay_paint) {
+    initscr();
+    internal_term();
+  }
 
   internal_loadfile(current_buffer);
+  internal_recover(current_buffer);
+  if (follow_first)
+    internal_follow_start();
   internal_edit();
   internal_exit();
 
+  if (replay_file != NULL)
+    internal_replay_report();
+
   return EXIT_SUCCESS;
 }
+#endif
 
 
 /**
  * Internal functions
  */
 
+uint64_t internal_clock() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
 bool internal_command() {
-  unsigned int i;
-  int c_length = strlen(c);
+  unsigned int      i;
+  int               count;
+  bool              result = true;
+  const KeyMapping *m;
+  KeyNode          *node   = (key_pending ? key_pending : key_tries[current_mode]);
   Selection s = {
     .start = current_buffer->cursor,
     .end = current_buffer->cursor
   };
 
-  for (i = 0; i < ARRAY_LENGTH(key_maps); ++i) {
-    if (key_maps[i].mode == current_mode) {
-      if (strncmp(c, key_maps[i].operator, c_length) == 0) {
-        return key_maps[i].action(current_buffer, &s);
-      }
-    }
+  // Count prefix, a leading '0' is still a command
+  if (current_mode == Mode_normal && !key_pending && c[1] == '\0' &&
+      c[0] >= '0' && c[0] <= '9' && (key_count || c[0] != '0')) {
+    key_count = (key_count * 10) + (c[0] - '0');
+    if (key_count > COUNT_MAX)
+      key_count = COUNT_MAX;
+    return false;
   }
 
-  return true;
+  for (i = 0; node && c[i] != '\0'; i++)
+    node = node->next[(unsigned char)c[i]];
+
+  // No mapping, the input is text unless it broke off a sequence
+  if (node == NULL) {
+    result = (key_pending == NULL && key_count == 0);
+    key_pending = NULL;
+    key_count = 0;
+    return result;
+  }
+
+  // Prefix of a longer sequence, wait for the rest
+  if (node->children) {
+    key_pending = node;
+    return false;
+  }
+
+  m = node->mapping;
+  count = key_count;
+  key_pending = NULL;
+  key_count = 0;
+
+  // Run all repetitions before the next repaint
+  current_count = count;
+  if (m->counted || count < 1)
+    result = m->action(current_buffer, &s);
+  else
+    while (count--)
+      result = m->action(current_buffer, &s);
+  current_count = 0;
+
+  // Everything from here to the next command outside insert mode is undone
+  // as one, including text typed after it
+  if (current_mode != Mode_insert)
+    buffer_seal(current_buffer);
+
+  return result;
 }
 
 void internal_edit() {
-  int ch;
-  int c_width;
+  int  c_width;
+  bool loading;
+  bool searching;
+  bool highlighting;
+  bool following;
 
   while (current_status & Status_running) {
-    internal_paint();
+    // Take in lines loaded meanwhile, and wake up again for more while loading.
+    // A search typed in the prompt, and highlighting, go on between keystrokes
+    loading = buffer_load_poll(current_buffer);
+    if (!loading && stats.load_pending)
+      internal_loaded();
+    searching = (current_mode == Mode_search && internal_search(SEARCHSIZ));
+    highlighting = internal_highlight(LEXSIZ);
+    following = internal_follow();
+    wtimeout(editor_window, ((searching || highlighting || following) ? 0 : loading ? LOADTICK : -1));
+
+    if (replay_file == NULL || replay_paint)
+      internal_paint();
 
     // Grab full utf8 character
-    if ((c_width = utf8_wgetch(editor_window, c)) == ERR) {
+    if ((c_width = internal_input(c)) == ERR) {
+      // Nothing typed, sleep until there is or the followed file changes
+      if (following && !searching && !highlighting)
+        internal_follow_wait(loading ? LOADTICK : -1);
       continue;
     }
 
-    ch = c[0];
+    if (stats.input_at == 0)
+      stats.input_at = internal_clock();
 
-    if (ch >= KEY_MIN)
+    if (c_width >= KEY_MIN) {
+      if (c_width == KEY_PASTE)
+        internal_paste();
+      else if (c_width == KEY_BACKSPACE && current_mode == Mode_search)
+        action_search_erase(current_buffer, NULL);
       continue;
+    }
 
     if (!internal_command())
       continue;
 
     if (current_mode == Mode_insert) {
       // TODO: Move to action
-      current_buffer->cursor = internal_insert(current_buffer->cursor, c, strlen(c));
-      current_status |= Status_dirty;
+      internal_insert_all(c, strlen(c));
+      current_buffer->dirty = true;
+    }
+    else if (current_mode == Mode_search && (search_length + strlen(c)) < SEARCHMAX) {
+      memcpy((search_prompt + search_length), c, strlen(c));
+      search_length += strlen(c);
+      internal_search_start();
     }
   }
 }
 
 void internal_exit() {
-  if (current_buffer != NULL) {
-    Line *l;
-    Line *n;
-
-    for (l = current_buffer->first_line; l != NULL; l = n) {
-      n = l->next;
-      free(l->c);
-      free(l);
-    }
+  size_t i;
+
+  if (stats_file != NULL)
+    internal_stats_dump();
+
+  if (record_file != NULL)
+    fclose(record_file);
+
+  internal_follow_stop();
 
-    if (current_buffer->filename != NULL)
-      free(current_buffer->filename);
-    free(current_buffer);
+  for (i = 0; i < buffers_count; i++) {
+    if (buffers[i].buffer != NULL)
+      buffer_free(buffers[i].buffer);
+    free(buffers[i].filename);
   }
+  free(buffers);
 
+  // Replaying without painting never set up the terminal
+  if (screen == NULL)
+    return;
+  free(screen);
+
+  printf(PASTE_DISABLE);
   endwin();
 }
 
-Position *internal_insert(Position *p, char *c, size_t size) {
-  unsigned int  i;
-  unsigned int  i_prev;
-  Position     *end_p;
-  char         *append_buffer = NULL;
-  unsigned int  append_length = 0;
-  Line         *l             = p->line;
-  Line         *l_next        = NULL;
-  unsigned int  p_offset      = p->offset;
-
-  end_p = (Position *)safe_calloc(1, sizeof(Position));
-  end_p->line = p->line;
-  end_p->offset = p->offset;
-
-  // XXX: Should I require a line or should I insert a line and set it to first
-  // if NULL?
-  // TODO: Possibly check to see if we're inserting between a multibyte char
-
-  // Split into lines
-  for (i_prev = i = 0; i <= size; i++) {
-    if ((c[i] == '\n') || (c[i] == '\0')) {
-      size_t diff = (i - i_prev);
-      size_t buckets = BUCKETS(l->length + diff);
-      size_t offset = ((size_t)c + i_prev);
-
-      // Resize
-      if (l->buckets < buckets) {
-        size_t capacity = (buckets * LINSIZ) + 1;
-        l->buckets = buckets;
-        l->c = safe_realloc(l->c, capacity);
-      }
+int internal_input(char *c) {
+  Keystroke k = { 0 };
+  uint64_t  now;
+  int       i;
 
-      // Insert in middle of line?
-      if ((int)p_offset != l->visual_length) {
-        append_length = (l->length - p_offset);
-        append_buffer = safe_calloc(append_length, sizeof(char));
-        memcpy(append_buffer, (l->c + p_offset), append_length);
-        memset((l->c + p_offset), 0, append_length); // XXX: append_length may need a +1
-        l->length -= append_length;
-      }
+  if (replay_file == NULL) {
+    if ((k.key = utf8_wgetch(editor_window, c)) != ERR && record_file != NULL) {
+      k.time = internal_clock() - record_start;
+      memcpy(k.c, c, sizeof(k.c));
+      fwrite(&k, sizeof(Keystroke), 1, record_file);
 
-      memcpy((l->c + p_offset), (void *)offset, diff);
-      l->length += diff;
-      l->visual_length = utf8_characters(l->c);
-      l->c[l->length] = '\0';
-      l->dirty = true;
+      // Flushed as typed, a recording matters most when the editor crashes
+      fflush(record_file);
+    }
+
+    return k.key;
+  }
 
-      if (c[i] == '\n') {
-        l_next = (Line *)safe_calloc(1, sizeof(Line));
-        l->dirty = true;
-        l_next->length = 0;
-        l_next->visual_length = 0;
-        l_next->buckets = 1;
-        l_next->c = (char *)safe_calloc(LINSIZ + 1, sizeof(char));
-        l_next->prev = l;
-        l_next->next = l->next;
-        l_next->prev->next = l_next;
-        if (l_next->next)
-          l_next->next->prev = l_next;
-
-        l = l_next;
-        i_prev = i + 1; // Skip new line character
+  // The previous keystroke took until now, keep it if it is among the slowest
+  now = internal_clock();
+  if (replay.count > 0) {
+    uint64_t ns = now - replay.key_at;
+
+    for (i = SLOWEST; i > 0 && ns > replay.slowest_ns[i - 1]; i--) {
+      if (i < SLOWEST) {
+        replay.slowest_ns[i] = replay.slowest_ns[i - 1];
+        replay.slowest[i] = replay.slowest[i - 1];
       }
+    }
 
-      // Insertion point for next line
-      p_offset = l->visual_length;
+    if (i < SLOWEST) {
+      replay.slowest_ns[i] = ns;
+      replay.slowest[i] = replay.keystroke;
     }
   }
 
-  // Final append
-  if (append_buffer) {
-    size_t buckets = BUCKETS(l->length + append_length);
+  // Stop once the recording ends
+  if (fread(&k, sizeof(Keystroke), 1, replay_file) != 1) {
+    current_status &= ~Status_running;
+    return ERR;
+  }
+
+  memcpy(c, k.c, sizeof(k.c));
+  replay.keystroke = k;
+  replay.key_at = internal_clock();
+  replay.count++;
 
-    if (buckets < l->buckets) {
-      l->buckets = buckets;
-      l->c = safe_realloc(l->c, (l->length + append_length + 1));
-      memset((l->c + p_offset), 0, (append_length + 1));
+  return k.key;
+}
+
+void internal_options(int argc, char *argv[]) {
+  static const struct option options[] = {
+    { "record",   required_argument, NULL, 'r' },
+    { "replay",   required_argument, NULL, 'p' },
+    { "no-paint", no_argument,       NULL, 'n' },
+    { "follow",   no_argument,       NULL, 'f' },
+    { NULL, 0, NULL, 0 }
+  };
+  int option;
+
+  while ((option = getopt_long(argc, argv, "f", options, NULL)) != -1) {
+    switch (option) {
+      case 'r':
+        if ((record_file = fopen(optarg, "w")) == NULL)
+          err(errno, "Unable to create recording: %s", optarg);
+        record_start = internal_clock();
+        break;
+
+      case 'p':
+        if ((replay_file = fopen(optarg, "r")) == NULL)
+          err(errno, "Unable to open recording: %s", optarg);
+        replay.start = internal_clock();
+        break;
+
+      case 'n':
+        replay_paint = false;
+        break;
+
+      case 'f':
+        follow_first = true;
+        break;
+
+      default:
+        errx(EX_USAGE, "usage: snack [--record FILE | --replay FILE [--no-paint]] [-f | --follow] [file ...]");
     }
+  }
 
-    memcpy((l->c + p_offset), append_buffer, append_length);
-    l->length += append_length;
-    l->visual_length = utf8_characters(l->c);
-    l->c[l->length] = '\0';
-    l->dirty = true;
-    free(append_buffer);
+  // The first file is viewed right away, the others once switched to
+  if (optind < argc)
+    current_buffer->filename = safe_strdup(argv[optind++]);
+
+  for (; optind < argc; optind++)
+    internal_open(argv[optind]);
+}
+
+void internal_replay_report() {
+  int i;
+  int k;
+
+  fprintf(stderr, "Replayed %zu keystrokes in %.3f ms\n", replay.count, ((internal_clock() - replay.start) / 1e6));
+
+  for (i = 0; i < SLOWEST && replay.slowest_ns[i] > 0; i++) {
+    fprintf(stderr, "%10.3f ms  at %10.3f s  ", (replay.slowest_ns[i] / 1e6), (replay.slowest[i].time / 1e9));
+
+    // Key codes by number, characters as typed (control characters escaped)
+    if (replay.slowest[i].key >= KEY_MIN)
+      fprintf(stderr, "key %d\n", replay.slowest[i].key);
+    else {
+      for (k = 0; k < 7 && replay.slowest[i].c[k] != '\0'; k++) {
+        unsigned char ch = replay.slowest[i].c[k];
+
+        if (ch < 0x20 || ch == 0x7f)
+          fprintf(stderr, "\\x%02x", ch);
+        else
+          fputc(ch, stderr);
+      }
+      fputc('\n', stderr);
+    }
   }
+}
+
+void internal_insert(Position *p, char *c, size_t size) {
+  Line   *l  = p->line;
+  size_t  at = line_byte_offset(l, p->offset);
+
+  // Keep the buffer well-formed, painting relies on it
+  if (!utf8_valid(c, size)) {
+    title_temp = "Refusing to insert malformed UTF-8";
+    return;
+  }
+
+  l = buffer_insert(current_buffer, l, &at, c, size);
+  stats.inserted += size;
 
   // Update selection
-  end_p->line = l;
-  end_p->offset = p_offset;
+  p->line = l;
+  p->offset = line_char_offset(l, at);
+}
+
+void internal_insert_all(char *c, size_t size) {
+  Buffer *b = current_buffer;
 
-  return end_p;
+  if (b->cursors_count == 0) {
+    internal_insert(b->cursor, c, size);
+    return;
+  }
+
+  if (!utf8_valid(c, size)) {
+    title_temp = "Refusing to insert malformed UTF-8";
+    return;
+  }
+
+  // All cursors in one pass, later ones are moved along by the earlier ones
+  buffer_insert_cursors(b, c, size);
+  stats.inserted += size * (b->cursors_count + 1);
+}
+
+void internal_delete(Position *p, int characters) {
+  Line   *l      = p->line;
+  int     offset = p->offset;
+  size_t  from   = line_byte_offset(l, offset);
+  size_t  at     = from;
+  size_t  size   = 0;
+
+  // Measure the characters in bytes, a line break counts as one of each
+  while (characters > 0) {
+    int available = (l->visual_length - offset);
+
+    if (available >= characters || line_next(current_buffer, l) == NULL) {
+      size += line_byte_offset(l, (offset + characters)) - at;
+      break;
+    }
+
+    size += (l->length - at) + 1;
+    characters -= available + 1;
+    l = l->next;
+    offset = 0;
+    at = 0;
+  }
+
+  buffer_delete(current_buffer, p->line, from, size);
+}
+
+void internal_keymap() {
+  unsigned int i;
+  unsigned int k;
+
+  for (i = 0; i < ARRAY_LENGTH(key_maps); ++i) {
+    const unsigned char *operator = (const unsigned char *)key_maps[i].operator;
+    KeyNode            **node     = &key_tries[key_maps[i].mode];
+
+    if (*node == NULL)
+      *node = (KeyNode *)safe_calloc(1, sizeof(KeyNode));
+
+    for (k = 0; operator[k] != '\0'; k++) {
+      KeyNode **next = &(*node)->next[operator[k]];
+
+      if (*next == NULL) {
+        *next = (KeyNode *)safe_calloc(1, sizeof(KeyNode));
+        (*node)->children++;
+      }
+
+      node = next;
+    }
+
+    (*node)->mapping = &key_maps[i];
+  }
 }
 
 void internal_loadfile(Buffer *buffer) {
-  int       fd;
-  ssize_t   bytes_read;
-  char      file_buffer[BUFSIZ + 1];
-  Position *last_position = buffer->cursor;
+  int         fd;
+  struct stat st;
+  ssize_t     bytes_read;
+  char       *original;
+  size_t      length   = 0;
+  size_t      capacity = READSIZ;
+  uint64_t    start    = internal_clock();
 
   if (!buffer->filename)
     return;
 
   // TODO: Remove lines in buffer and reset cursor?
 
-  if ((fd = open(buffer->filename, O_RDONLY | O_CREAT)) == -1)
+  if ((fd = open(buffer->filename, (O_RDONLY | O_CREAT), 0666)) == -1)
     err(errno, "Unable to open file: %s", buffer->filename);
 
-  while ((bytes_read = read(fd, file_buffer, BUFSIZ))) {
+  if (fstat(fd, &st) == -1)
+    err(errno, "Unable to stat file: %s", buffer->filename);
+
+  // Map regular files, pages are only faulted in as lines are materialised
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    if ((original = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+      buffer_attach(buffer, original, st.st_size, fd);
+      buffer_load(buffer);
+      stats.load_ns = internal_clock() - start;
+      stats.load_pending = true;
+      return;
+    }
+  }
+
+  // Otherwise read everything into the original buffer, in large reads and in
+  // one go when the size is known
+  if (S_ISREG(st.st_mode) && (size_t)st.st_size >= capacity)
+    capacity = st.st_size + 1;
+  original = safe_malloc(capacity);
+
+  while ((bytes_read = read(fd, (original + length), (capacity - length)))) {
     if (bytes_read == -1)
       err(errno, "Unable to read file: %s", buffer->filename);
-    file_buffer[BUFSIZ] = '\0';
-    last_position = internal_insert(last_position, file_buffer, bytes_read);
+
+    length += bytes_read;
+
+    if (length == capacity) {
+      capacity *= 2;
+      original = safe_realloc(original, capacity);
+    }
   }
 
   if (close(fd) == ERR)
     err(errno, "Unable to close file");
 
-  buffer->last_line = last_position->line;;
-  buffer->cursor->line = buffer->first_line;
-  buffer->cursor->offset = 0;
+  buffer_attach(buffer, original, length, -1);
+  buffer_load(buffer);
+  stats.load_ns = internal_clock() - start;
+  stats.load_pending = true;
 }
 
-void internal_paint() {
-  int i;
-  Line *l;
-  int cursor_row = 0;
-  unsigned int total_lines = 0;
+void internal_open(const char *filename) {
+  Entry *e;
 
-  // Paint editor window
-  {
-    // Naive-implementation (unoptimized, no-scrolling, no-wrapping, paints from 0,0)
-    int cols;
-    int rows_visible;
-    int rows_left;
-    Line *l = current_buffer->first_line;
-
-    getmaxyx(editor_window, rows_visible, cols);
-    rows_left = rows_visible;
-
-    while (rows_left && l) {
-      /* if (l->dirty) { */
-        wchar_t row[cols];
-        memset(row, '\0', cols);
-        if ((int)mbstowcs(row, l->c, cols) == ERR)
-          err(errno, "Unable to convert multi-byte string to widechar string");
-        wmove(editor_window, (rows_visible - rows_left), 0);
-        wclrtoeol(editor_window);
-        waddwstr(editor_window, row);
-        /* mvwaddwstr(editor_window, (rows_visible - rows_left), 0, row); */
-        /* l->dirty = false; */
-      /* } */
+  buffers = (Entry *)safe_realloc(buffers, ((buffers_count + 1) * sizeof(Entry)));
+  e = &buffers[buffers_count++];
+
+  memset(e, 0, sizeof(Entry));
+  e->filename = safe_strdup(filename);
+  e->cursor_line = e->top_line = 1;
+}
+
+void internal_switch(size_t index) {
+  Entry *e = &buffers[index];
+  int    row;
+
+  if (e->buffer == NULL) {
+    Buffer *b = buffer_new();
+
+    b->journal.budget = undo_budget;
+    b->filename = e->filename;
+    e->filename = NULL;
+    internal_loadfile(b);
+    internal_recover(b);
+
+    // Back where it was when unloaded, the lines up to there split first
+    if (buffer_lines(b) < MAX(e->cursor_line, e->top_line))
+      buffer_split(b, (MAX(e->cursor_line, e->top_line) - buffer_lines(b)));
+
+    b->cursor->line = buffer_line(b, e->cursor_line);
+    b->cursor->offset = MIN(e->cursor_offset, b->cursor->line->visual_length);
+    b->offset_prev = b->cursor->offset;
+    b->top = buffer_line(b, e->top_line);
+    b->left = e->left;
+    e->buffer = b;
+  }
+
+  current_buffer = e->buffer;
+  buffers_current = index;
+  e->viewed = ++buffers_viewed;
+
+  // Nothing on screen belongs to it
+  for (row = 0; screen != NULL && row < rows - 1; row++)
+    screen[row].painted = false;
+
+  internal_evict();
+}
 
-      if (l == current_buffer->cursor->line)
-        cursor_row = (rows_visible - rows_left);
+void internal_unload(Entry *e) {
+  Buffer *b = e->buffer;
 
-      rows_left--;
+  e->cursor_line = line_number(b->cursor->line);
+  e->cursor_offset = b->cursor->offset;
+  e->top_line = line_number(b->top);
+  e->left = b->left;
+  e->filename = b->filename;
+  b->filename = NULL;
 
-      l = l->next;
+  buffer_free(b);
+  e->buffer = NULL;
+}
+
+void internal_evict() {
+  size_t memory = 0;
+  size_t i;
+
+  for (i = 0; i < buffers_count; i++) {
+    if (buffers[i].buffer != NULL)
+      memory += buffer_memory(buffers[i].buffer);
+  }
+
+  // Least recently viewed first, changes are never dropped
+  while (memory > memory_limit) {
+    Entry *oldest = NULL;
+
+    for (i = 0; i < buffers_count; i++) {
+      Entry *e = &buffers[i];
+
+      if (e->buffer == NULL || e->buffer == current_buffer || e->buffer->dirty || e->buffer->filename == NULL)
+        continue;
+      if (oldest == NULL || e->viewed < oldest->viewed)
+        oldest = e;
+    }
+
+    if (oldest == NULL)
+      break;
+
+    memory -= buffer_memory(oldest->buffer);
+    internal_unload(oldest);
+  }
+}
+
+void internal_recover(Buffer *buffer) {
+  static char message[BUFSIZ];
+  long        replayed;
+
+  if (!swap_journal)
+    return;
+
+  if ((replayed = buffer_swap_open(buffer)) == -1 && errno == EWOULDBLOCK) {
+    snprintf(message, BUFSIZ, "Swap file in use by another session, changes are not journaled");
+  }
+  else if (replayed == -1) {
+    snprintf(message, BUFSIZ, "Unable to open swap file: %s", strerror(errno));
+  }
+  else if (replayed > 0) {
+    snprintf(message, BUFSIZ, "Recovered %ld changes from the swap file", replayed);
+    buffer->dirty = true;
+  }
+  else {
+    return;
+  }
+
+  title_temp = swap_notice = message;
+}
+
+void internal_paint() {
+  int         cursor_row    = 0;
+  int         cursor_column = 0;
+  uint64_t    start         = internal_clock();
+  size_t      written       = ((stats_visible || stats_file) ? internal_written() : 0);
+  const char *shape;
+  bool        changed;
+
+  stats.rows = 0;
+
+  // Paint editor window, only rows that changed since the last frame
+  {
+    int    rows_visible = getmaxy(editor_window);
+    int    cols_visible = getmaxx(editor_window);
+    int    row;
+    int    column;
+    int    x            = line_column(current_buffer->cursor->line, current_buffer->cursor->offset);
+    bool   dirty        = false;
+    Line  *l;
+
+    // Extra cursors dropped (by any change but typing) are painted over
+    if (current_buffer->cursors_count < cursors_painted) {
+      for (row = 0; row < rows_visible; row++)
+        screen[row].painted = false;
+    }
+    cursors_painted = current_buffer->cursors_count;
+
+    // Keep the cursor in view
+    if (wrap)
+      internal_view_wrap(rows_visible, cols_visible, x);
+    else
+      internal_view(rows_visible, cols_visible, x);
+
+    for (row = 0, l = current_buffer->top, column = current_buffer->left; row < rows_visible; row++) {
+      if (l) {
+        // A line is only marked clean once, it may take several rows
+        if (row == 0 || column == 0 || !wrap) {
+          dirty = l->dirty;
+          l->dirty = false;
+        }
+
+        if (dirty || !screen[row].painted || screen[row].line != l || screen[row].column != column)
+          internal_paint_line(l, column, row);
+
+        if (l == current_buffer->cursor->line && x >= column &&
+            (!wrap || x < column + cols_visible || column + cols_visible > line_width(l))) {
+          cursor_row = row;
+          cursor_column = x - column;
+        }
+
+        if (!wrap || column + cols_visible > line_width(l)) {
+          l = line_next(current_buffer, l);
+          column = (wrap ? 0 : current_buffer->left);
+        }
+        else
+          column += cols_visible;
+      }
+      else if (!screen[row].painted || screen[row].line != NULL) {
+        wmove(editor_window, row, 0);
+        wclrtoeol(editor_window);
+        screen[row].line = NULL;
+        screen[row].painted = true;
+        stats.rows++;
+      }
     }
   }
 
   // Cursor
   if (current_buffer->cursor->line)
-    wmove(editor_window, cursor_row, current_buffer->cursor->offset);
+    wmove(editor_window, cursor_row, cursor_column);
 
   switch (current_mode) {
     case Mode_insert:
-      printf(CURSOR_BAR_BLINK);
+      shape = CURSOR_BAR_BLINK;
       break;
 
     case Mode_replace:
-      printf(CURSOR_UNDERLINE_BLINK);
+      shape = CURSOR_UNDERLINE_BLINK;
       break;
 
     case Mode_normal:
     default:
-      printf(CURSOR_BLOCK);
-
-  }
-
-  // Paint status window
-  wmove(status_window, 0, 0);
-  for (i = 0; i < cols; i++)
-    waddch(status_window, ' ');
+      shape = CURSOR_BLOCK;
 
-  // Count lines
-  // TODO: Cache
-  if ((l = current_buffer->first_line)) {
-    total_lines = 1;
-    while ((l = l->next))
-      total_lines++;
   }
 
+  // Status window
   if (title_temp) {
     snprintf(title, BUFSIZ, "%s", title_temp);
   }
+  else if (current_mode == Mode_search) {
+    snprintf(title, BUFSIZ, "%c%.*s%s", (search_backward ? '?' : '/'), (int)search_length, search_prompt,
+        (!search.done ? " (searching)" : (search.match == NULL && search.length) ? " (not found)" : ""));
+  }
   else {
-    snprintf(title, BUFSIZ, "Snack %s%s (%s) ␤%d,%d:%d",
+    char buffer_tag[32];
+    int  written;
+
+    snprintf(buffer_tag, sizeof(buffer_tag), "[%zu/%zu] ", (buffers_current + 1), buffers_count);
+    written = snprintf(title, BUFSIZ, "Snack %s%s%s%s (%s) ␤%zu,%zu%s:%d",
+        (buffers_count > 1 ? buffer_tag : ""),
         (current_buffer->filename ? current_buffer->filename : "<No Name>"),
-        (current_status & Status_dirty ? "[+]" : ""),
+        (current_buffer->dirty ? "[+]" : ""),
+        (follow_buffer == current_buffer ? "[follow]" : ""),
         (current_mode == Mode_insert ? "Insert" : "Normal"),
-        (cursor_row + 1),
-        total_lines,
+        line_number(current_buffer->cursor->line),
+        buffer_lines(current_buffer),
+        (buffer_partial(current_buffer) ? "+" : ""),
         (current_buffer->cursor->offset + 1));
+
+    if (current_buffer->loader && written > 0 && written < BUFSIZ)
+      snprintf((title + written), (BUFSIZ - written), " Loading %d%%",
+          (int)((current_buffer->original_split * 100) / current_buffer->original_length));
   }
 
   title_temp = NULL;
 
-  mvwaddnstr(status_window, 0, 0, title, cols);
+  // Counters on the right, over the end of the title if need be. Timings are
+  // the previous frame's
+  if (stats_visible) {
+    char   counters[BUFSIZ];
+    int    length = snprintf(counters, BUFSIZ, " paint %.2fms rows %d out %zuB input %.2fms alloc %zu ins %zuB mem %.1fM ",
+        (stats.frame_ns / 1e6), stats.rows, stats.written, (stats.latency_ns / 1e6),
+        stats.allocations, stats.inserted, (stats.memory / 1048576.0));
+    int    used   = 0;
+    size_t at     = 0;
+
+    if (length > 0 && length < cols) {
+      while (title[at] != '\0') {
+        size_t n     = utf8_width(title[at]);
+        int    cells = utf8_ncells((title + at), n);
+
+        if (used + cells > cols - length)
+          break;
+        used += cells;
+        at += n;
+      }
+
+      snprintf((title + at), (BUFSIZ - at), "%*s%s", (cols - length - used), "", counters);
+    }
+  }
+
+  // The whole line in one go, and only when it changed. The rest of the row
+  // is cleared to the (reversed) background
+  if (strcmp(title, status) != 0) {
+    mvwaddnstr(status_window, 0, 0, title, -1);
+    wclrtoeol(status_window);
+    snprintf(status, BUFSIZ, "%s", title);
+  }
+
+  // Terminals that support synchronized updates show a frame with repainted
+  // rows all at once (a frame that only moves the cursor or changes the status
+  // line cannot tear). The cursor shape is only sent when it changes. Both go
+  // out in one write, curses writes the frame itself
+  changed = (stats.rows > 0);
+
+  if (changed && sync_updates)
+    fputs(SYNC_BEGIN, stdout);
+
+  if (shape != cursor_shape) {
+    fputs(shape, stdout);
+    cursor_shape = shape;
+  }
+
+  fflush(stdout);
 
   // Go
   wnoutrefresh(status_window);
   wnoutrefresh(editor_window);
   doupdate();
+
+  if (changed && sync_updates) {
+    fputs(SYNC_END, stdout);
+    fflush(stdout);
+  }
+
+  internal_stats(start, written);
+}
+
+void internal_paint_line(Line *l, int column, int row) {
+  int            cols      = getmaxx(editor_window);
+  bool           highlight = internal_highlighted(current_buffer);
+  size_t         from      = 0;
+  size_t         lexed     = 0;
+  size_t         length    = 0;
+  size_t         size;
+  size_t         run       = 0;
+  char          *bytes;
+  unsigned char *classes;
+  unsigned char  class     = Class_text;
+  wchar_t       *wide;
+  mbstate_t      state;
+  int            pad       = 0;
+  int            cells;
+
+  // Only the bytes that can possibly be visible are flattened, starting at the
+  // first column shown (found from the line's checkpoints). Highlighting lexes
+  // from the start of the line, unless that is too far back
+  if (column < line_width(l)) {
+    int offset = line_column_offset(l, column);
+
+    // A wide character cut by the left edge is left out
+    if (line_column(l, offset) < column) {
+      offset++;
+      pad = line_column(l, offset) - column;
+    }
+
+    from = line_byte_offset(l, offset);
+    lexed = ((highlight && from <= SYNTAXMAX) ? from : 0);
+  }
+
+  size = (lexed + (cols * MB_LEN_MAX) + sizeof(wchar_t)) & ~(sizeof(wchar_t) - 1); // Aligned
+  bytes = buffer_scratch(current_buffer, ((2 * size) + (2 * cols * sizeof(wchar_t))));
+  classes = (unsigned char *)(bytes + size);
+  wide = (wchar_t *)(bytes + (2 * size));
+
+  if (column < line_width(l)) {
+    length = line_copy(l, (from - lexed), bytes, (lexed + (cols * MB_LEN_MAX)));
+
+    if (highlight)
+      syntax_line(bytes, length, (l->prev ? l->prev->syntax_out : Syntax_normal), classes);
+  }
+
+  wmove(editor_window, row, 0);
+  wclrtoeol(editor_window);
+  wmove(editor_window, row, pad);
+
+  // As many characters as fit in the row (up to two a cell, with combining
+  // marks), written a run of one colour at a time
+  memset(&state, 0, sizeof(mbstate_t));
+  for (from = lexed, cells = pad; from < length && run < (size_t)(2 * cols);) {
+    wchar_t ch;
+    size_t  n = mbrtowc(&ch, (bytes + from), (length - from), &state);
+
+    // Cut off at the end of the copy
+    if (n == (size_t)-2)
+      break;
+
+    if (n == (size_t)-1) {
+      memset(&state, 0, sizeof(mbstate_t));
+      ch = 0xFFFD;
+      n = 1;
+    }
+    else if (n == 0)
+      n = 1;
+
+    if (cells + utf8_cells(ch) > cols)
+      break;
+
+    if (highlight && classes[from] != class) {
+      wattrset(editor_window, COLOR_PAIR(class));
+      waddnwstr(editor_window, wide, run);
+      class = classes[from];
+      run = 0;
+    }
+
+    wide[run++] = ch;
+    cells += utf8_cells(ch);
+    from += n;
+  }
+
+  wattrset(editor_window, COLOR_PAIR(class));
+  waddnwstr(editor_window, wide, run);
+  wattrset(editor_window, A_NORMAL);
+
+  // Extra cursors on the row, shown reversed
+  if (current_buffer->cursors_count > 0) {
+    size_t i;
+
+    for (i = buffer_cursor_find(current_buffer, l, 0); i < current_buffer->cursors_count && current_buffer->cursors[i].line == l; i++) {
+      int x = line_column(l, current_buffer->cursors[i].offset) - column;
+
+      if (x >= 0 && x < cols)
+        mvwchgat(editor_window, row, x, 1, A_REVERSE, 0, NULL);
+    }
+  }
+
+  screen[row].line = l;
+  screen[row].column = column;
+  screen[row].painted = true;
+  stats.rows++;
+}
+
+void internal_view(int rows_visible, int cols_visible, int x) {
+  size_t top    = line_number(current_buffer->top);
+  size_t cursor = line_number(current_buffer->cursor->line);
+
+  if (cursor < top)
+    internal_scroll((long)cursor - (long)top);
+  else if (cursor >= top + rows_visible)
+    internal_scroll((long)(cursor - (top + rows_visible - 1)));
+
+  // Scroll sideways by half a screen, so typing on does not shift every keystroke
+  if (x < current_buffer->left || x >= current_buffer->left + cols_visible)
+    current_buffer->left = MAX(0, (x - (cols_visible / 2)));
+}
+
+void internal_view_wrap(int rows_visible, int cols_visible, int x) {
+  Buffer *b      = current_buffer;
+  Line   *cursor = b->cursor->line;
+  int     column = x - (x % cols_visible); // Cursor row, in its line
+  int     row;
+  Line   *l;
+
+  // The top line may have shrunk, or the window changed width
+  b->left = MIN(b->left, line_width(b->top));
+  b->left -= (b->left % cols_visible);
+
+  // Above the view, the cursor goes on the first row
+  if (line_number(cursor) < line_number(b->top) || (cursor == b->top && column < b->left)) {
+    b->top = cursor;
+    b->left = column;
+    return;
+  }
+
+  // Rows down to the cursor, giving up past the bottom
+  for (row = -(b->left / cols_visible), l = b->top; l != cursor && row < rows_visible; l = line_next(b, l))
+    row += (line_width(l) / cols_visible) + 1;
+
+  if (l == cursor && row + (column / cols_visible) < rows_visible)
+    return;
+
+  // Below the view, the cursor goes on the last row
+  for (row = (column / cols_visible), l = cursor; row < rows_visible - 1 && l->prev; l = l->prev)
+    row += (line_width(l->prev) / cols_visible) + 1;
+
+  b->top = l;
+  b->left = MAX(0, (row - (rows_visible - 1))) * cols_visible;
+}
+
+bool internal_highlighted(Buffer *b) {
+  const char *extension;
+  int         i;
+
+  if (!syntax_highlight || b->filename == NULL || (extension = strrchr(b->filename, '.')) == NULL)
+    return false;
+
+  for (i = 0; syntax_extensions[i]; i++) {
+    if (strcmp(extension, syntax_extensions[i]) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+bool internal_highlight(size_t budget) {
+  Buffer     *b = current_buffer;
+  Line       *l = b->unlexed;
+  size_t      number;
+  size_t      until;
+  SyntaxState state;
+
+  if (l == NULL || !internal_highlighted(b))
+    return false;
+
+  // Lines below the view are only lexed once they come into view
+  number = line_number(l);
+  until = line_number(b->top) + rows;
+  if (number > until)
+    return false;
+
+  // Lines already lexed from the same state are left alone, so after an edit
+  // only lines up to where the states match again are lexed
+  state = (l->prev ? l->prev->syntax_out : Syntax_normal);
+  for (; l != NULL && number <= until && budget > 0; number++, budget--) {
+    if (!l->lexed || l->syntax_in != state) {
+      char *bytes = buffer_scratch(b, (l->length + 1));
+
+      line_copy(l, 0, bytes, l->length);
+      l->syntax_in = state;
+      l->syntax_out = syntax_line(bytes, l->length, state, NULL);
+      l->lexed = true;
+      l->dirty = true;
+    }
+
+    state = l->syntax_out;
+    l = line_next(b, l);
+  }
+
+  b->unlexed = l;
+
+  return (l != NULL && number <= until);
+}
+
+void internal_follow_start() {
+  static char message[BUFSIZ];
+  Buffer     *b = current_buffer;
+
+  if (b->filename == NULL || (follow_file = open(b->filename, (O_RDONLY | O_CLOEXEC))) == -1) {
+    snprintf(message, BUFSIZ, "Unable to follow file: %s", (b->filename ? strerror(errno) : "No name"));
+    title_temp = message;
+    return;
+  }
+
+#ifdef __linux__
+  if ((follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1)
+    follow_watch = inotify_add_watch(follow_fd, b->filename, FOLLOW_EVENTS);
+#endif
+
+  follow_buffer = b;
+  follow_changed = true;
+
+  // To the end, where the cursor is kept while lines come in
+  buffer_split(b, SIZE_MAX);
+  b->cursor->line = b->last_line;
+  b->cursor->offset = b->offset_prev = 0;
+}
+
+void internal_follow_stop() {
+  if (follow_fd != -1)
+    close(follow_fd);
+  if (follow_file != -1)
+    close(follow_file);
+
+  follow_fd = follow_file = follow_watch = -1;
+  follow_buffer = NULL;
+  follow_changed = false;
+}
+
+bool internal_follow() {
+  Buffer     *b = current_buffer;
+  struct stat st;
+  struct stat file;
+  bool        pinned;
+
+  if (follow_buffer == NULL)
+    return false;
+
+  // Only the buffer in view is followed, and only as long as it is unchanged
+  if (follow_buffer != b || b->dirty) {
+    internal_follow_stop();
+    title_temp = "Stopped following";
+    return false;
+  }
+
+#ifdef __linux__
+  // Which events arrived does not matter, the file is looked at either way
+  if (follow_fd != -1) {
+    _Alignas(struct inotify_event) char events[BUFSIZ];
+    ssize_t n;
+    ssize_t at;
+
+    while ((n = read(follow_fd, events, sizeof(events))) > 0) {
+      for (at = 0; at < n; at += sizeof(struct inotify_event) + ((struct inotify_event *)(events + at))->len) {
+        if (((struct inotify_event *)(events + at))->mask & IN_IGNORED)
+          follow_watch = -1;
+      }
+      follow_changed = true;
+    }
+  }
+#endif
+
+  // Nothing watches a file that was removed (or without inotify), so it is
+  // looked at on every wake up
+  if (follow_watch == -1)
+    follow_changed = true;
+
+  if (!follow_changed || buffer_partial(b))
+    return true;
+
+  follow_changed = false;
+
+  // A rotated file may not be replaced yet, it is looked for again
+  if (stat(b->filename, &st) == -1 || fstat(follow_file, &file) == -1) {
+    follow_changed = true;
+    return true;
+  }
+
+  // Rotated or truncated, the file is read again from the start
+  if (st.st_ino != file.st_ino || st.st_dev != file.st_dev || (size_t)st.st_size < b->file_length) {
+    internal_follow_stop();
+    internal_unload(&buffers[buffers_current]);
+    internal_switch(buffers_current);
+    internal_follow_start();
+    return (follow_buffer != NULL);
+  }
+
+  // Only the bytes added since are read, the view stays at the end if the
+  // cursor was there
+  pinned = (b->cursor->line == b->last_line);
+
+  if (buffer_follow(b, follow_file, st.st_size) > 0 && pinned) {
+    b->cursor->line = b->last_line;
+    b->cursor->offset = b->offset_prev = 0;
+  }
+
+  return true;
+}
+
+void internal_follow_wait(int timeout) {
+  struct pollfd fds[2] = {
+    { .fd = STDIN_FILENO, .events = POLLIN },
+    { .fd = follow_fd, .events = POLLIN } // Left out when -1
+  };
+
+  if (follow_fd == -1 || follow_watch == -1 || follow_changed)
+    timeout = (timeout == -1 ? FOLLOWTICK : MIN(timeout, FOLLOWTICK));
+
+  poll(fds, 2, timeout);
+}
+
+void internal_scroll(long lines) {
+  int    rows_visible = getmaxy(editor_window);
+  size_t top          = line_number(current_buffer->top);
+  int    row;
+
+  current_buffer->top = buffer_line(current_buffer, (top + lines));
+
+  if (labs(lines) >= rows_visible) {
+    for (row = 0; row < rows_visible; row++)
+      screen[row].painted = false;
+    return;
+  }
+
+  // Let the terminal shift what is already there
+  scrollok(editor_window, TRUE);
+  wscrl(editor_window, lines);
+  scrollok(editor_window, FALSE);
+
+  if (lines > 0) {
+    memmove(screen, (screen + lines), ((rows_visible - lines) * sizeof(Row)));
+    for (row = (rows_visible - lines); row < rows_visible; row++)
+      screen[row].painted = false;
+  }
+  else {
+    memmove((screen - lines), screen, ((rows_visible + lines) * sizeof(Row)));
+    for (row = 0; row < -lines; row++)
+      screen[row].painted = false;
+  }
+}
+
+void internal_paste() {
+  int     ch;
+  char    bytes[7];
+  bool    cr       = false;
+  size_t  length   = 0;
+  size_t  capacity = BUFSIZ;
+  char   *paste    = buffer_scratch(current_buffer, capacity);
+  char   *repaired = NULL;
+
+  // A loading tick must not cut the paste short, and escape sequences in it
+  // are text, not keys: the end marker is looked for in the raw bytes
+  wtimeout(editor_window, -1);
+  keypad(editor_window, FALSE);
+
+  // Collect everything up to the end marker, nothing is painted meanwhile
+  while ((ch = internal_input(bytes)) != KEY_PASTE_END && ch != ERR) {
+    int k;
+
+    if (ch >= KEY_MIN)
+      continue;
+
+    if (length + ch > capacity) {
+      capacity *= 2;
+      paste = buffer_scratch(current_buffer, capacity);
+    }
+
+    // Terminals send line breaks as CR (or CRLF)
+    for (k = 0; k < ch; k++) {
+      if (bytes[k] == '\n' && cr) {
+        cr = false;
+        continue;
+      }
+      cr = (bytes[k] == '\r');
+      paste[length++] = (cr ? '\n' : bytes[k]);
+    }
+
+    if (length >= strlen(PASTE_END) && memcmp((paste + length - strlen(PASTE_END)), PASTE_END, strlen(PASTE_END)) == 0) {
+      length -= strlen(PASTE_END);
+      break;
+    }
+  }
+
+  keypad(editor_window, TRUE);
+
+  if (length == 0)
+    return;
+
+  // Malformed bytes are replaced, the rest of the paste still goes in
+  if (!utf8_valid(paste, length)) {
+    repaired = safe_malloc(length * strlen(REPLACEMENT));
+    length = internal_repair(paste, length, repaired);
+    paste = repaired;
+  }
+
+  // Into the prompt while searching, line breaks and backslashes escaped as
+  // if typed, as much as fits
+  if (current_mode == Mode_search) {
+    size_t i;
+    size_t size;
+
+    for (i = 0; i < length; i += size) {
+      bool escape = (paste[i] == '\n' || paste[i] == '\\');
+
+      size = utf8_width(paste[i]);
+      if (search_length + (escape ? 2 : size) >= SEARCHMAX)
+        break;
+
+      if (escape) {
+        search_prompt[search_length++] = '\\';
+        search_prompt[search_length++] = (paste[i] == '\n' ? 'n' : '\\');
+      }
+      else {
+        memcpy((search_prompt + search_length), (paste + i), size);
+        search_length += size;
+      }
+    }
+
+    internal_search_start();
+  }
+  else {
+    // A paste is undone on its own, in one step
+    buffer_seal(current_buffer);
+    internal_insert_all(paste, length);
+    buffer_seal(current_buffer);
+    current_buffer->dirty = true;
+  }
+
+  free(repaired);
+}
+
+size_t internal_repair(const char *c, size_t size, char *dest) {
+  size_t length = 0;
+  size_t i      = 0;
+
+  while (i < size) {
+    size_t width = utf8_width(c[i]);
+
+    if (i + width <= size && utf8_valid((c + i), width)) {
+      memcpy((dest + length), (c + i), width);
+      length += width;
+      i += width;
+    }
+    else {
+      memcpy((dest + length), REPLACEMENT, strlen(REPLACEMENT));
+      length += strlen(REPLACEMENT);
+      i++;
+    }
+  }
+
+  return length;
+}
+
+void internal_search_start() {
+  char   pattern[SEARCHMAX];
+  size_t length = 0;
+  size_t i;
+
+  for (i = 0; i < search_length; i++) {
+    if (search_prompt[i] == '\\' && (i + 1) < search_length && (search_prompt[i + 1] == 'n' || search_prompt[i + 1] == '\\'))
+      pattern[length++] = (search_prompt[++i] == 'n' ? '\n' : '\\');
+    else
+      pattern[length++] = search_prompt[i];
+  }
+
+  buffer_search_start(current_buffer, &search, pattern, length, search_backward, search.origin, search.origin_at);
+}
+
+bool internal_search(size_t budget) {
+  Position *c = current_buffer->cursor;
+
+  if (search.done)
+    return false;
+
+  if (buffer_search_step(current_buffer, &search, budget))
+    return true;
+
+  // Show the match, or go back to where the search started
+  c->line = (search.match ? search.match : search.origin);
+  c->offset = line_char_offset(c->line, (search.match ? search.match_at : search.origin_at));
+
+  return false;
+}
+
+bool internal_search_again(bool backward) {
+  static char message[BUFSIZ];
+  Position   *c = current_buffer->cursor;
+  char        pattern[SEARCHMAX];
+  size_t      length = search.length;
+
+  if (length == 0) {
+    title_temp = "No previous pattern";
+    return false;
+  }
+
+  memcpy(pattern, search.pattern, length);
+  buffer_search_start(current_buffer, &search, pattern, length, backward, c->line, line_byte_offset(c->line, c->offset));
+  internal_search(SIZE_MAX);
+
+  if (search.match == NULL) {
+    snprintf(message, BUFSIZ, "Pattern not found: %.*s", (int)search_length, search_prompt);
+    title_temp = message;
+    return false;
+  }
+
+  current_buffer->offset_prev = c->offset;
+
+  return true;
+}
+
+void internal_stats(uint64_t start, size_t written) {
+  uint64_t end         = internal_clock();
+  size_t   allocations = safe_allocations;
+
+  stats.frame_ns = end - start;
+  stats.written = ((stats_visible || stats_file) ? internal_written() - written : 0);
+  stats.allocations = allocations - stats.allocations_at;
+  stats.allocations_at = allocations;
+  stats.latency_ns = (stats.input_at ? end - stats.input_at : 0);
+
+  // Walking the buffer's blocks is only worth it when someone looks
+  if (stats_visible || stats_file)
+    stats.memory = buffer_memory(current_buffer);
+
+  stats.frames++;
+  stats.frame_ns_total += stats.frame_ns;
+  if (stats.frame_ns > stats.frame_ns_max)
+    stats.frame_ns_max = stats.frame_ns;
+  stats.rows_total += stats.rows;
+  stats.written_total += stats.written;
+  stats.allocations_total += stats.allocations;
+  stats.inserted_total += stats.inserted;
+  stats.inserted = 0;
+  if (stats.memory > stats.memory_max)
+    stats.memory_max = stats.memory;
+
+  if (stats.input_at) {
+    stats.inputs++;
+    stats.latency_ns_total += stats.latency_ns;
+    if (stats.latency_ns > stats.latency_ns_max)
+      stats.latency_ns_max = stats.latency_ns;
+    stats.input_at = 0;
+  }
+}
+
+void internal_stats_dump() {
+  FILE *f;
+
+  if ((f = fopen(stats_file, "w")) == NULL)
+    return;
+
+  fprintf(f, "frames %zu\n", stats.frames);
+  fprintf(f, "paint_ms_total %.3f\n", (stats.frame_ns_total / 1e6));
+  fprintf(f, "paint_ms_max %.3f\n", (stats.frame_ns_max / 1e6));
+  fprintf(f, "rows_painted %zu\n", stats.rows_total);
+  fprintf(f, "terminal_bytes %zu\n", stats.written_total);
+  fprintf(f, "terminal_bytes_per_frame %.1f\n", (stats.frames ? (double)stats.written_total / stats.frames : 0));
+  fprintf(f, "inputs %zu\n", stats.inputs);
+  fprintf(f, "input_latency_ms_mean %.3f\n", (stats.inputs ? (stats.latency_ns_total / 1e6) / stats.inputs : 0));
+  fprintf(f, "input_latency_ms_max %.3f\n", (stats.latency_ns_max / 1e6));
+  fprintf(f, "allocations %zu\n", stats.allocations_total);
+  fprintf(f, "inserted_bytes %zu\n", stats.inserted_total);
+  fprintf(f, "memory_bytes_max %zu\n", stats.memory_max);
+  fprintf(f, "loaded_bytes %zu\n", stats.load_bytes_total);
+  fprintf(f, "load_gbps %.3f\n", (stats.load_ns_total ? (double)stats.load_bytes_total / stats.load_ns_total : 0));
+
+  fclose(f);
+}
+
+void internal_loaded() {
+  static char message[BUFSIZ];
+  uint64_t    ns    = stats.load_ns + current_buffer->split_ns;
+  size_t      bytes = current_buffer->original_length;
+
+  stats.load_pending = false;
+  stats.load_ns_total += ns;
+  stats.load_bytes_total += bytes;
+
+  // What opening the swap file reported matters more
+  if (swap_notice) {
+    title_temp = swap_notice;
+    swap_notice = NULL;
+    return;
+  }
+
+  if (bytes == 0)
+    return;
+
+  snprintf(message, sizeof(message), "%zu lines, %zu bytes%s%s in %.1fms (%.2f GB/s)",
+      buffer_lines(current_buffer), bytes,
+      (current_buffer->crlf ? " [CRLF]" : ""), (current_buffer->bom ? " [BOM]" : ""),
+      (ns / 1e6), (ns ? (double)bytes / ns : 0));
+  title_temp = message;
+}
+
+size_t internal_written() {
+#ifdef __linux__
+  // curses writes to the terminal itself, the kernel counts what this thread
+  // wrote (other threads write files, not the terminal)
+  char    io[512];
+  char   *wchar;
+  ssize_t length;
+  int     fd;
+
+  if ((fd = open("/proc/thread-self/io", O_RDONLY)) == -1 && (fd = open("/proc/self/io", O_RDONLY)) == -1)
+    return 0;
+
+  length = read(fd, io, (sizeof(io) - 1));
+  close(fd);
+
+  if (length <= 0)
+    return 0;
+
+  io[length] = '\0';
+
+  if ((wchar = strstr(io, "wchar: ")) != NULL)
+    return strtoull((wchar + 7), NULL, 10);
+#endif
+
+  return 0;
 }
 
 void internal_setup() {
-  Line *l = (Line *)safe_calloc(1, sizeof(Line));
-  l->dirty = true;
-  l->c = (char *)safe_calloc(LINSIZ + 1, sizeof(char));
-  l->buckets = 1;
-  l->length = 0;
-  l->visual_length = 0;
-  l->prev = NULL;
-  l->next = NULL;
-
-  current_buffer = (Buffer *)safe_calloc(1, sizeof(Buffer));
-  current_buffer->cursor = (Position *)safe_calloc(1, sizeof(Position));
-  current_buffer->cursor->offset = 0;
-  current_buffer->cursor->line = l;
-  current_buffer->offset_prev = 0;
-  current_buffer->first_line = l;
-  current_buffer->last_line = l;
+  internal_keymap();
+
+  current_buffer = buffer_new();
+  current_buffer->journal.budget = undo_budget;
+  buffers = (Entry *)safe_calloc(1, sizeof(Entry));
+  buffers[0].buffer = current_buffer;
+  buffers_count = 1;
   current_mode = Mode_normal;
   current_status = Status_running;
-
-  initscr();
-  internal_term();
+  wrap = soft_wrap;
 }
 
 void internal_term() {
+  int i;
+
   // Initialize terminal
   raw();
   curs_set(1);
+  start_color();
   use_default_colors();
   noecho();
   nl();
   set_escdelay(25);
   getmaxyx(stdscr, rows, cols);
 
+  // Highlighter colours, on the default background
+  for (i = 1; has_colors() && i < CLASSES; i++)
+    init_pair(i, syntax_colors[i], -1);
+
+  // Bracketed paste, the markers arrive as keys
+  define_key(PASTE_START, KEY_PASTE);
+  define_key(PASTE_END, KEY_PASTE_END);
+  printf(PASTE_ENABLE);
+  fflush(stdout);
+
   // Editor windows
   if (editor_window)
     delwin(editor_window);
 
   editor_window = newwin((rows - 1), cols, 1, 0);
+  screen = safe_realloc(screen, ((rows - 1) * sizeof(Row)));
+  memset(screen, 0, ((rows - 1) * sizeof(Row)));
 
   idlok(editor_window, TRUE);
   keypad(editor_window, TRUE);
@@ -380,49 +1482,12 @@ void internal_term() {
   /* keypad(status_window, TRUE); */
   /* meta(status_window, TRUE); */
   /* nodelay(status_window, FALSE); */
-  wattron(status_window, A_REVERSE);
+  wbkgd(status_window, A_REVERSE);
   /* wtimeout(status_window, 0); */
-}
-
 
-/**
- * Safe memory function wrappers
- */
-
-void *safe_calloc(size_t nmemb, size_t size) {
-  void *ptr;
-
-  if ((ptr = calloc(nmemb, size)) == NULL)
-    err(errno, "Unable to allocate memory (calloc)");
-
-  return ptr;
-}
-
-void *safe_malloc(size_t size) {
-  void *ptr;
-
-  if ((ptr = malloc(size)) == NULL)
-    err(errno, "Unable to allocate memory (malloc)");
-
-  return ptr;
-}
-
-void *safe_realloc(void *ptr, size_t size) {
-  void *new_ptr;
-
-  if ((new_ptr = realloc(ptr, size)) == NULL)
-    err(errno, "Unable to allocate memory (realloc)");
-
-  return new_ptr;
-}
-
-static char *safe_strdup(const char *s) {
-  char *ptr;
-
-  if ((ptr = strdup(s)) == NULL)
-    err(errno, "Unable to duplicate string");
-
-  return ptr;
+  // Nothing is on the terminal yet
+  status[0] = '\0';
+  cursor_shape = NULL;
 }
 
 
@@ -449,7 +1514,7 @@ bool action_move_nextline(Buffer *b, Selection *s) {
   Position *c = b->cursor;
   Line *l = c->line;
 
-  if (l->next) {
+  if (line_next(b, l)) {
     c->line = l->next;
 
     if ((l->next->visual_length < c->offset) || (l->next->visual_length < b->offset_prev))
@@ -502,7 +1567,13 @@ bool action_move_prevchar(Buffer *b, Selection *s) {
 
 bool action_move_bof(Buffer *b, Selection *s) {
   Position *c = b->cursor;
-  Line *l = b->first_line;
+  Line *l;
+
+  // With a count, go to that line instead
+  if (current_count > 0 && (size_t)current_count > buffer_lines(b))
+    buffer_split(b, (current_count - buffer_lines(b)));
+
+  l = buffer_line(b, (current_count > 0 ? (size_t)current_count : 1));
 
   c->line = l;
 
@@ -516,7 +1587,16 @@ bool action_move_bof(Buffer *b, Selection *s) {
 
 bool action_move_eof(Buffer *b, Selection *s) {
   Position *c = b->cursor;
-  Line *l = b->last_line;
+  Line *l;
+
+  // With a count, go to that line, the end of file is only known once
+  // everything is split
+  if (current_count > 0)
+    return action_move_bof(b, s);
+
+  buffer_split(b, SIZE_MAX);
+
+  l = buffer_line(b, buffer_lines(b));
 
   c->line = l;
 
@@ -541,14 +1621,222 @@ bool action_move_eol(Buffer *b, Selection *s) {
 bool action_insert_line(Buffer *b, Selection *s) {
   action_move_eol(b, s);
 
-  b->cursor = internal_insert(b->cursor, "\n", 1);
+  internal_insert(b->cursor, "\n", 1);
 
-  current_status |= Status_dirty;
+  b->dirty = true;
 
   action_move_bol(b, s);
 
-  // XXX: This might not work if the cursor is moved, maybe repaint whole screen?
-  wclrtobot(editor_window);
+  return true;
+}
+
+bool action_delete_char(Buffer *b, Selection *s) {
+  Position *c = b->cursor;
+
+  // Stays on the line, joining is left to explicit line deletion
+  if (c->offset >= c->line->visual_length)
+    return true;
+
+  internal_delete(c, 1);
+
+  b->dirty = true;
+
+  if (c->offset > 0 && c->offset >= c->line->visual_length)
+    b->offset_prev = --(c->offset);
+
+  return true;
+}
+
+bool action_delete_line(Buffer *b, Selection *s) {
+  Position *c = b->cursor;
+  Line     *l = c->line;
+
+  b->dirty = true;
+
+  // Take the line with its line break, or the one before it on the last line
+  if (line_next(b, l)) {
+    c->offset = 0;
+    internal_delete(c, (l->visual_length + 1));
+  }
+  else if (l->prev) {
+    c->line = l->prev;
+    c->offset = l->prev->visual_length;
+    internal_delete(c, (l->visual_length + 1));
+    c->offset = 0;
+  }
+  else {
+    c->offset = 0;
+    internal_delete(c, l->visual_length);
+  }
+
+  // Keep the column, clamped to the line now under the cursor
+  if (c->line->visual_length < b->offset_prev)
+    c->offset = c->line->visual_length;
+  else
+    c->offset = b->offset_prev;
 
   return true;
 }
+
+bool action_undo(Buffer *b, Selection *s) {
+  Line   *l;
+  size_t  at;
+
+  if (!buffer_undo(b, &l, &at)) {
+    title_temp = "Already at oldest change";
+    return false;
+  }
+
+  b->dirty = true;
+
+  b->cursor->line = l;
+  b->offset_prev = b->cursor->offset = line_char_offset(l, at);
+
+  return true;
+}
+
+bool action_redo(Buffer *b, Selection *s) {
+  Line   *l;
+  size_t  at;
+
+  if (!buffer_redo(b, &l, &at)) {
+    title_temp = "Already at newest change";
+    return false;
+  }
+
+  b->dirty = true;
+
+  b->cursor->line = l;
+  b->offset_prev = b->cursor->offset = line_char_offset(l, at);
+
+  return true;
+}
+
+bool action_search_forward(Buffer *b, Selection *s) {
+  Position *c = b->cursor;
+
+  // Empty until something is typed, the prompt restarts it from here
+  buffer_search_start(b, &search, "", 0, false, c->line, line_byte_offset(c->line, c->offset));
+  search_length = 0;
+  search_backward = false;
+  current_mode = Mode_search;
+
+  return false;
+}
+
+bool action_search_backward(Buffer *b, Selection *s) {
+  action_search_forward(b, s);
+  search_backward = true;
+
+  return false;
+}
+
+bool action_search_accept(Buffer *b, Selection *s) {
+  static char message[BUFSIZ];
+
+  // Whatever is left of the buffer is searched now
+  internal_search(SIZE_MAX);
+  current_mode = Mode_normal;
+  b->offset_prev = b->cursor->offset;
+
+  if (search.match == NULL && search.length) {
+    snprintf(message, BUFSIZ, "Pattern not found: %.*s", (int)search_length, search_prompt);
+    title_temp = message;
+  }
+
+  return false;
+}
+
+bool action_search_cancel(Buffer *b, Selection *s) {
+  Position *c = b->cursor;
+
+  search.done = true;
+  c->line = search.origin;
+  c->offset = line_char_offset(c->line, search.origin_at);
+  current_mode = Mode_normal;
+
+  return false;
+}
+
+bool action_search_erase(Buffer *b, Selection *s) {
+  // Erasing past the start of the pattern leaves the prompt
+  if (search_length == 0)
+    return action_search_cancel(b, s);
+
+  while (search_length > 0 && (search_prompt[--search_length] & 0xC0) == 0x80)
+    ;
+  internal_search_start();
+
+  return false;
+}
+
+bool action_search_next(Buffer *b, Selection *s) {
+  return internal_search_again(search_backward);
+}
+
+bool action_search_prev(Buffer *b, Selection *s) {
+  return internal_search_again(!search_backward);
+}
+
+bool action_stats(Buffer *b, Selection *s) {
+  stats_visible = !stats_visible;
+  return false;
+}
+
+bool action_buffer_next(Buffer *b, Selection *s) {
+  internal_switch((buffers_current + 1) % buffers_count);
+  return false;
+}
+
+bool action_buffer_prev(Buffer *b, Selection *s) {
+  internal_switch((buffers_current + buffers_count - 1) % buffers_count);
+  return false;
+}
+
+bool action_cursor_add(Buffer *b, Selection *s) {
+  // The new cursor stays behind, the main one goes on to the next line
+  if (buffer_cursor_add(b, b->cursor->line, b->cursor->offset))
+    b->cursor->line->dirty = true;
+
+  return action_move_nextline(b, s);
+}
+
+bool action_cursor_clear(Buffer *b, Selection *s) {
+  b->cursors_count = 0;
+
+  return false;
+}
+
+bool action_wrap(Buffer *b, Selection *s) {
+  wrap = !wrap;
+  return false;
+}
+
+bool action_follow(Buffer *b, Selection *s) {
+  bool following = (follow_buffer == b);
+
+  internal_follow_stop();
+  if (!following)
+    internal_follow_start();
+
+  return false;
+}
+
+bool action_save(Buffer *b, Selection *s) {
+  static char message[BUFSIZ];
+
+  if (b->filename == NULL) {
+    title_temp = "No file name";
+    return false;
+  }
+
+  if (buffer_save(b, save_fsync) == -1) {
+    snprintf(message, BUFSIZ, "Unable to save %s: %s", b->filename, strerror(errno));
+    title_temp = message;
+    return false;
+  }
+
+  b->dirty = false;
+
+  return false;
+}
@@ -6,16 +6,29 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libc.h>
+#include <limits.h>
 #include <locale.h>
 #include <ncurses.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "buffer.h"
+#include "safe.h"
+#include "syntax.h"
 #include "utf8.h"
 
 /* Constants */
@@ -25,72 +38,160 @@
 #define CURSOR_BLOCK_BLINK     "\x1b[\x30 q"
 #define CURSOR_UNDERLINE       "\x1b[\x34 q"
 #define CURSOR_UNDERLINE_BLINK "\x1b[\x33 q"
-#define LINSIZ                 64
+#define SYNC_BEGIN             "\x1b[?2026h"
+#define SYNC_END               "\x1b[?2026l"
+#define PASTE_ENABLE           "\x1b[?2004h"
+#define PASTE_DISABLE          "\x1b[?2004l"
+#define PASTE_START            "\x1b[200~"
+#define PASTE_END              "\x1b[201~"
+#define KEY_PASTE              (KEY_MAX + 1)
+#define KEY_PASTE_END          (KEY_MAX + 2)
+#define REPLACEMENT            "\xEF\xBF\xBD" // U+FFFD, stands in for malformed bytes of a paste
+
+#define COUNT_MAX              999999
+#define LOADTICK               100 // Milliseconds between repaints while a file loads
+#define READSIZ                1048576 // Bytes read at a time from files that cannot be mapped
+#define FOLLOWTICK             1000 // Milliseconds between checks of a followed file nothing watches
+#define FOLLOW_EVENTS          (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) // Changes to a followed file
+#define SEARCHSIZ              1048576 // Bytes searched between keystrokes
+#define SLOWEST                10   // Slowest keystrokes reported after a replay
+#define LEXSIZ                 4096 // Lines highlighted between keystrokes
+#define SYNTAXMAX              65536 // Bytes before a row's first column lexed to colour it exactly
+#define MODES                  (Mode_search + 1)
 
 /* Macros */
 #define ARRAY_LENGTH(array) (sizeof(array) / sizeof(array[0]))
-#define BUCKETS(length)     ((length) / LINSIZ + ((length) % LINSIZ != 0))
+#define MIN(a, b)           ((a) < (b) ? (a) : (b))
+#define MAX(a, b)           ((a) > (b) ? (a) : (b))
 
 /* Enums */
 typedef enum {
   Mode_normal,                    // Normal mode
   Mode_insert,                    // Insert mode
-  Mode_replace                    // Replace mode
+  Mode_replace,                   // Replace mode
+  Mode_search                     // Search pattern prompt
 } Mode ;
 
 typedef enum {
-  Status_running = 1,             // Run main edit loop
-  Status_dirty   = 1 << 1         // Current buffer is dirty (TODO: Move to buffer)
+  Status_running = 1              // Run main edit loop
 } Status ;
 
 /* Types */
-typedef struct Line Line;
-struct Line {
-  char   *c;                      // Line content
-  size_t buckets;                 // Buckets of LINSIZ used to allocate c
-  int    length;                  // Line length in bytes
-  int    visual_length;           // Line "character" count
-  bool   dirty;                   // Needs a repaint?
-  Line  *prev;                    // Previous line
-  Line  *next;                    // Next line
-};
-
-typedef struct Position {
-  int   offset;                   // Offset in line
-  Line *line;                     // Line of position
-} Position;
-
-typedef struct Selection {
-  Position *start;
-  Position *end;
-} Selection;
-
-typedef struct Buffer {
-  Position *cursor;               // Position in buffer
-  int       offset_prev;          // Previous cursor offset, used for maintaining column on vertical movement
-  char     *filename;             // Filename
-  Line     *first_line;           // First line of file
-  Line     *last_line;            // Last line of file
-} Buffer;
+typedef struct Row {
+  Line *line;                     // Line shown on the row (NULL past the end of buffer)
+  int   column;                   // First column of the line shown on the row
+  bool  painted;                  // Whether the row is known to show it
+} Row;
+
+typedef struct Stats {
+  uint64_t frame_ns;              // Time spent painting the last frame
+  int      rows;                  // Rows repainted in the last frame
+  size_t   written;               // Bytes written to the terminal for the last frame
+  uint64_t latency_ns;            // From reading input to the end of the frame showing it
+  size_t   allocations;           // Heap allocations since the frame before
+  size_t   inserted;              // Bytes inserted since the frame before
+  size_t   memory;                // Buffer memory footprint after the last frame
+  uint64_t input_at;              // When the oldest input not painted yet was read (0 if none)
+  size_t   allocations_at;        // Allocation count at the end of the last frame
+  size_t   frames;                // Totals since start, for the dump on exit...
+  uint64_t frame_ns_total;
+  uint64_t frame_ns_max;
+  size_t   rows_total;
+  size_t   written_total;
+  size_t   inputs;
+  uint64_t latency_ns_total;
+  uint64_t latency_ns_max;
+  size_t   allocations_total;
+  size_t   inserted_total;
+  size_t   memory_max;
+  uint64_t load_ns;               // Time reading (or mapping) the current buffer's file took
+  bool     load_pending;          // Its load is not reported yet, the loader may still run
+  uint64_t load_ns_total;
+  size_t   load_bytes_total;
+} Stats;
+
+typedef struct Entry {
+  Buffer  *buffer;                // Buffer, NULL until first viewed and once unloaded
+  char    *filename;              // File to load the buffer from while it is not loaded
+  size_t   cursor_line;           // Cursor line while not loaded
+  int      cursor_offset;         // Cursor offset while not loaded
+  size_t   top_line;              // First line in view while not loaded
+  int      left;                  // First column in view while not loaded
+  uint64_t viewed;                // When last viewed (by switch count)
+} Entry;
+
+typedef struct Keystroke {
+  uint64_t time;                  // Nanoseconds since recording started
+  int32_t  key;                   // What `utf8_wgetch` returned (bytes, or a key code)
+  char     c[7];                  // Character bytes read
+} Keystroke;
+
+typedef struct Replay {
+  size_t    count;                // Keystrokes replayed
+  uint64_t  start;                // When the replay started
+  uint64_t  key_at;               // When the last keystroke was read
+  Keystroke keystroke;            // The last keystroke read
+  uint64_t  slowest_ns[SLOWEST];  // Slowest keystrokes, slowest first
+  Keystroke slowest[SLOWEST];
+} Replay;
 
 typedef struct KeyMapping {
   Mode  mode;                     // Mode the mapping applies to (e.g. Mode_normal)
   char *operator;                 // String to match
   bool  (*action)(Buffer *b, Selection *s);
+  bool  counted;                  // Action reads the count itself instead of being repeated
 } KeyMapping;
 
+typedef struct KeyNode KeyNode;
+struct KeyNode {
+  const KeyMapping *mapping;      // Mapping matched by the bytes so far, if any
+  unsigned int      children;     // Number of longer sequences continuing from here
+  KeyNode          *next[256];    // Next node for each following byte
+};
+
 
 /* State variables */
 static char    c[7];              // Input
 static int     cols;              // Columns
 static int     rows;              // Rows
 static char    title[BUFSIZ];     // Editor title
+static char    status[BUFSIZ];    // Status line as last painted
+static const char *cursor_shape;  // Cursor shape escape last sent (NULL if none)
 static char   *title_temp = NULL; // Temporary editor title
+static char   *swap_notice;       // What opening the swap file reported, shown again once loaded
 static WINDOW *editor_window;     // Main editor window
 static WINDOW *status_window;     // Status bar window
+static Row    *screen;            // Editor window rows as last painted
 static Buffer *current_buffer;    // Current buffer
+static Entry  *buffers;           // Buffer list
+static size_t  buffers_count;     // Buffers in the list
+static size_t  buffers_current;   // Index of the current buffer in the list
+static uint64_t buffers_viewed;   // Buffer switches so far
 static Mode    current_mode;      // Current mode of the editor
+static int     current_count;     // Count given to the running action (0 if none)
+static KeyNode *key_tries[MODES]; // Key mappings compiled into a trie per mode
+static KeyNode *key_pending;      // Partially matched key sequence
+static int     key_count;         // Count prefix typed so far
 static long    current_status;    // Current status of the editor
+static Search  search;            // Running (or last) search
+static char    search_prompt[SEARCHMAX]; // Pattern as typed, `\n` stands for a line break
+static size_t  search_length;     // Pattern length in bytes
+static bool    search_backward;   // Direction of the pattern
+static Stats   stats;             // Performance counters
+static FILE   *record_file;       // Keystrokes read are logged here (--record)
+static FILE   *replay_file;       // Keystrokes are read from here instead of the terminal (--replay)
+static bool    replay_paint = true; // Whether to paint while replaying (--no-paint)
+static uint64_t record_start;     // When recording started
+static Replay  replay;            // Replay timings
+static bool    stats_visible;     // Whether the counters are shown in the status bar
+static bool    wrap;              // Whether long lines wrap onto following rows
+static bool    follow_first;      // Follow the first file from the start (--follow)
+static Buffer *follow_buffer;     // Buffer following its growing file (NULL if none)
+static int     follow_file = -1;  // The followed file, open for reading
+static int     follow_fd = -1;    // inotify instance watching it (-1 without inotify)
+static int     follow_watch = -1; // Watch on the file, -1 once it is gone
+static bool    follow_changed;    // The file changed since the buffer last caught up
+static size_t  cursors_painted;   // Extra cursors shown in the last frame
 
 /* Actions */
 static bool action_quit();
@@ -109,4 +210,29 @@ static bool action_move_eol(Buffer *b, Selection *s);
 
 static bool action_insert_line(Buffer *b, Selection *s);
 
+static bool action_delete_char(Buffer *b, Selection *s);
+static bool action_delete_line(Buffer *b, Selection *s);
+
+static bool action_undo(Buffer *b, Selection *s);
+static bool action_redo(Buffer *b, Selection *s);
+
+static bool action_cursor_add(Buffer *b, Selection *s);
+static bool action_cursor_clear(Buffer *b, Selection *s);
+
+static bool action_search_forward(Buffer *b, Selection *s);
+static bool action_search_backward(Buffer *b, Selection *s);
+static bool action_search_accept(Buffer *b, Selection *s);
+static bool action_search_cancel(Buffer *b, Selection *s);
+static bool action_search_erase(Buffer *b, Selection *s);
+static bool action_search_next(Buffer *b, Selection *s);
+static bool action_search_prev(Buffer *b, Selection *s);
+
+static bool action_save(Buffer *b, Selection *s);
+
+static bool action_stats(Buffer *b, Selection *s);
+static bool action_wrap(Buffer *b, Selection *s);
+static bool action_follow(Buffer *b, Selection *s);
+static bool action_buffer_next(Buffer *b, Selection *s);
+static bool action_buffer_prev(Buffer *b, Selection *s);
+
 #endif /* ifndef SNACK_H */
@@ -0,0 +1,140 @@
+#include "syntax.h"
+
+#include <string.h>
+
+/* Macros */
+#define MARK(from, to, k) do { if (classes) memset((classes + (from)), (k), ((to) - (from))); } while (0)
+#define IDENT(ch)         (((ch) >= 'a' && (ch) <= 'z') || ((ch) >= 'A' && (ch) <= 'Z') || ((ch) >= '0' && (ch) <= '9') || (ch) == '_')
+
+/* Internal functions */
+static Class internal_word(const char *s, size_t n); // Class of an identifier
+
+/* Words */
+static const char *keywords[] = {
+  "break", "case", "continue", "default", "do", "else", "for", "goto", "if",
+  "return", "sizeof", "switch", "while", "true", "false", "NULL", NULL
+};
+
+static const char *types[] = {
+  "auto", "bool", "char", "const", "double", "enum", "extern", "float", "inline",
+  "int", "long", "register", "restrict", "short", "signed", "size_t", "ssize_t",
+  "static", "struct", "typedef", "union", "unsigned", "void", "volatile", NULL
+};
+
+SyntaxState syntax_line(const char *s, size_t n, SyntaxState state, unsigned char *classes) {
+  size_t i = 0;
+  size_t start;
+
+  while (i < n) {
+    switch (state) {
+      case Syntax_comment:
+        for (start = i; i < n; i++) {
+          if (s[i] == '*' && i + 1 < n && s[i + 1] == '/') {
+            state = Syntax_normal;
+            i += 2;
+            break;
+          }
+        }
+        MARK(start, i, Class_comment);
+        break;
+
+      case Syntax_string:
+      case Syntax_character: {
+        char quote = (state == Syntax_string ? '"' : '\'');
+
+        for (start = i; i < n; i++) {
+          if (s[i] == '\\') {
+            i++;
+          }
+          else if (s[i] == quote) {
+            state = Syntax_normal;
+            i++;
+            break;
+          }
+        }
+
+        if (i > n)
+          i = n;
+        MARK(start, i, Class_string);
+        break;
+      }
+
+      case Syntax_directive:
+        for (start = i; i < n && !(s[i] == '/' && i + 1 < n && (s[i + 1] == '/' || s[i + 1] == '*')); i++);
+        MARK(start, i, Class_directive);
+        if (i < n)
+          state = Syntax_normal;
+        break;
+
+      case Syntax_normal:
+      default:
+        start = i;
+
+        if (s[i] == '/' && i + 1 < n && s[i + 1] == '/') {
+          MARK(i, n, Class_comment);
+          return Syntax_normal;
+        }
+        else if (s[i] == '/' && i + 1 < n && s[i + 1] == '*') {
+          MARK(i, (i + 2), Class_comment);
+          state = Syntax_comment;
+          i += 2;
+        }
+        else if (s[i] == '"' || s[i] == '\'') {
+          MARK(i, (i + 1), Class_string);
+          state = (s[i] == '"' ? Syntax_string : Syntax_character);
+          i++;
+        }
+        else if (s[i] == '#') {
+          size_t k;
+
+          // Only first on the line
+          for (k = 0; k < i && (s[k] == ' ' || s[k] == '\t'); k++);
+          MARK(i, (i + 1), (k == i ? Class_directive : Class_text));
+          if (k == i)
+            state = Syntax_directive;
+          i++;
+        }
+        else if (s[i] >= '0' && s[i] <= '9') {
+          for (i++; i < n && (IDENT(s[i]) || s[i] == '.'); i++);
+          MARK(start, i, Class_number);
+        }
+        else if (IDENT(s[i])) {
+          for (i++; i < n && IDENT(s[i]); i++);
+          MARK(start, i, internal_word((s + start), (i - start)));
+        }
+        else {
+          MARK(i, (i + 1), Class_text);
+          i++;
+        }
+    }
+  }
+
+  // Only comments, and whatever ends in a backslash, go on to the next line
+  if (state == Syntax_comment)
+    return state;
+  if (n > 0 && s[n - 1] == '\\')
+    return state;
+
+  return Syntax_normal;
+}
+
+
+/**
+ * Internal functions
+ */
+
+Class internal_word(const char *s, size_t n) {
+  int i;
+
+  for (i = 0; keywords[i]; i++) {
+    if (strncmp(keywords[i], s, n) == 0 && keywords[i][n] == '\0')
+      return Class_keyword;
+  }
+
+  for (i = 0; types[i]; i++) {
+    if (strncmp(types[i], s, n) == 0 && types[i][n] == '\0')
+      return Class_type;
+  }
+
+  return Class_text;
+}
@@ -0,0 +1,40 @@
+#ifndef SYNTAX_H
+#define SYNTAX_H 1
+
+#include <stddef.h>
+
+/* Enums */
+typedef enum {
+  Syntax_normal,                  // Code
+  Syntax_comment,                 // Inside a block comment
+  Syntax_string,                  // Inside a string literal
+  Syntax_character,               // Inside a character literal
+  Syntax_directive                // Inside a preprocessor directive
+} SyntaxState;
+
+typedef enum {
+  Class_text,                     // Anything else
+  Class_keyword,                  // Statement keyword
+  Class_type,                     // Type name or qualifier
+  Class_number,                   // Numeric literal
+  Class_string,                   // String or character literal
+  Class_comment,                  // Comment
+  Class_directive,                // Preprocessor directive
+  CLASSES
+} Class;
+
+/**
+ * Tokenise a line of C-like code, starting in the state the previous line
+ * ended in. Strings and directives continue onto the next line after a
+ * trailing backslash, block comments until they are closed.
+ *
+ * @param s [const char *] Line content, without the line break
+ * @param n [size_t] Number of bytes
+ * @param state [SyntaxState] State at the start of the line
+ * @param classes [unsigned char *] Class of every byte, or NULL for only the end state
+ *
+ * @return [SyntaxState] State at the end of the line
+ */
+SyntaxState syntax_line(const char *s, size_t n, SyntaxState state, unsigned char *classes);
+
+#endif
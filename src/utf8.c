@@ -1,4 +1,75 @@
 #include "utf8.h"
+#include "cells.h"
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Constants */
+// Error classes of a byte pair in the lookup-table validator, a pair is valid
+// unless all three of its lookups share one
+#define TOO_SHORT      (1 << 0)   // Lead byte followed by a lead byte or ASCII
+#define TOO_LONG       (1 << 1)   // ASCII followed by a continuation byte
+#define OVERLONG_3     (1 << 2)   // E0 80..9F
+#define TOO_LARGE      (1 << 3)   // F4 90..BF, F5..FF
+#define SURROGATE      (1 << 4)   // ED A0..BF
+#define OVERLONG_2     (1 << 5)   // C0..C1
+#define TOO_LARGE_1000 (1 << 6)   // F5..FF 80..8F
+#define OVERLONG_4     (1 << 6)   // F0 80..8F
+#define TWO_CONTS      (1 << 7)   // Two continuation bytes, fine only as the 3rd/4th byte
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS) // Classes not decided by the low nibble
+
+#if defined(__SSSE3__)
+static const unsigned char byte_1_high[16] = { // By the high nibble of the first byte
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+  TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+  TOO_SHORT | OVERLONG_2,
+  TOO_SHORT,
+  TOO_SHORT | OVERLONG_3 | SURROGATE,
+  TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+static const unsigned char byte_1_low[16] = { // By the low nibble of the first byte
+  CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+  CARRY | OVERLONG_2,
+  CARRY,
+  CARRY,
+  CARRY | TOO_LARGE,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+static const unsigned char byte_2_high[16] = { // By the high nibble of the second byte
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+static const unsigned char block_end[32] = { // Largest bytes a block may end in, not cutting a sequence
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF
+};
+
+static __m128i internal_classify16(__m128i v, __m128i prev);    // Errors of a 16 byte block, given the block before
+static size_t  internal_boundary(const unsigned char *u, size_t i); // Start of the sequence a block ends in
+#endif
+#if defined(__AVX2__)
+static __m256i internal_classify32(__m256i v, __m256i prev);    // Errors of a 32 byte block, given the block before
+#endif
 
 unsigned int utf8_width(char ch) {
   if (~ch & 0x80)
@@ -17,32 +88,276 @@ unsigned int utf8_width(char ch) {
 }
 
 int utf8_characters(char *s) {
-  unsigned int i = 0;
-  unsigned int length = 0;
-  unsigned int offset;
+  size_t n = strlen(s);
 
-  while (s[i++] != '\0') {
-    length++;
+  if (!utf8_valid(s, n))
+    return ERR;
 
-    if ((offset = utf8_width(s[i - 1])) > 1) {
-      while (--offset) {
-        if ((s[i++] & 0xC0) != 0x80)
-          return ERR;
-      }
-    }
+  return utf8_ncharacters(s, n);
+}
+
+int utf8_ncharacters(const char *s, size_t n) {
+  size_t i      = 0;
+  int    length = 0;
+
+  // Count continuation bytes (0x80-0xBF, i.e. below -64 as signed) a vector at
+  // a time and subtract them
+#if defined(__AVX2__)
+  const __m256i limit32 = _mm256_set1_epi8(-64);
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    length += 32 - __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(limit32, v)));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i limit16 = _mm_set1_epi8(-64);
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    length += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(v, limit16)));
+  }
+#endif
+
+  for (; i < n; i++) {
+    if ((s[i] & 0xC0) != 0x80)
+      length++;
   }
 
   return length;
 }
 
+size_t utf8_line(const char *s, size_t n, int *characters) {
+  size_t   i      = 0;
+  int      length = 0;
+  unsigned breaks;
+  unsigned continuation;
+
+  // Both masks come from the same load: the first line break ends the line,
+  // continuation bytes before it are not characters
+#if defined(__AVX2__)
+  const __m256i limit32 = _mm256_set1_epi8(-64);
+  const __m256i break32 = _mm256_set1_epi8('\n');
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+
+    breaks = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, break32));
+    continuation = _mm256_movemask_epi8(_mm256_cmpgt_epi8(limit32, v));
+
+    if (breaks) {
+      unsigned at = __builtin_ctz(breaks);
+
+      *characters = length + at - __builtin_popcount(continuation & ((1u << at) - 1));
+      return i + at;
+    }
+
+    length += 32 - __builtin_popcount(continuation);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i limit16 = _mm_set1_epi8(-64);
+  const __m128i break16 = _mm_set1_epi8('\n');
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+
+    breaks = _mm_movemask_epi8(_mm_cmpeq_epi8(v, break16));
+    continuation = _mm_movemask_epi8(_mm_cmplt_epi8(v, limit16));
+
+    if (breaks) {
+      unsigned at = __builtin_ctz(breaks);
+
+      *characters = length + at - __builtin_popcount(continuation & ((1u << at) - 1));
+      return i + at;
+    }
+
+    length += 16 - __builtin_popcount(continuation);
+  }
+#endif
+
+  (void)breaks;
+  (void)continuation;
+
+  for (; i < n && s[i] != '\n'; i++) {
+    if ((s[i] & 0xC0) != 0x80)
+      length++;
+  }
+
+  *characters = length;
+
+  return i;
+}
+
+bool utf8_valid(const char *s, size_t n) {
+  const unsigned char *u = (const unsigned char *)s;
+  size_t               i = 0;
+
+  // Whole blocks are classified by lookup tables, without branching on the
+  // text. An ASCII block only needs the one before to end a sequence, the
+  // sequence the last block ends in is left to the loop below
+#if defined(__AVX2__)
+  if (n >= 32) {
+    const __m256i end = _mm256_loadu_si256((const __m256i *)block_end);
+    __m256i       prev  = _mm256_setzero_si256();
+    __m256i       error = _mm256_setzero_si256();
+
+    for (; i + 32 <= n; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(u + i));
+
+      if (_mm256_movemask_epi8(v))
+        error = _mm256_or_si256(error, internal_classify32(v, prev));
+      else
+        error = _mm256_or_si256(error, _mm256_subs_epu8(prev, end));
+      prev = v;
+    }
+
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(error, _mm256_setzero_si256())) != -1)
+      return false;
+
+    i = internal_boundary(u, i);
+  }
+#endif
+#if defined(__SSSE3__)
+  if (n - i >= 16) {
+    const __m128i end = _mm_loadu_si128((const __m128i *)(block_end + 16));
+    __m128i       prev  = _mm_setzero_si128();
+    __m128i       error = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(u + i));
+
+      if (_mm_movemask_epi8(v))
+        error = _mm_or_si128(error, internal_classify16(v, prev));
+      else
+        error = _mm_or_si128(error, _mm_subs_epu8(prev, end));
+      prev = v;
+    }
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF)
+      return false;
+
+    i = internal_boundary(u, i);
+  }
+#endif
+
+  while (i < n) {
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    size_t        continuation;
+    size_t        k;
+
+    // Skip runs of ASCII a vector at a time
+#if defined(__AVX2__)
+    while (i + 32 <= n && !_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(u + i))))
+      i += 32;
+#endif
+#if defined(__SSE2__)
+    while (i + 16 <= n && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(u + i))))
+      i += 16;
+#endif
+
+    if (i >= n)
+      break;
+
+    if (u[i] < 0x80) {
+      i++;
+      continue;
+    }
+
+    // Reject overlong forms, surrogates and anything above U+10FFFF
+    if (u[i] >= 0xC2 && u[i] <= 0xDF)
+      continuation = 1;
+    else if (u[i] >= 0xE0 && u[i] <= 0xEF)
+      continuation = 2;
+    else if (u[i] >= 0xF0 && u[i] <= 0xF4)
+      continuation = 3;
+    else
+      return false;
+
+    if (u[i] == 0xE0)
+      lo = 0xA0;
+    else if (u[i] == 0xED)
+      hi = 0x9F;
+    else if (u[i] == 0xF0)
+      lo = 0x90;
+    else if (u[i] == 0xF4)
+      hi = 0x8F;
+
+    if (continuation >= (n - i))
+      return false;
+
+    for (k = 1; k <= continuation; k++) {
+      unsigned char ch = u[i + k];
+
+      if (ch < lo || ch > hi)
+        return false;
+
+      lo = 0x80;
+      hi = 0xBF;
+    }
+
+    i += continuation + 1;
+  }
+
+  return true;
+}
+
+int utf8_cells(uint32_t cp) {
+  if (cp >= 0x110000)
+    return 1;
+
+  return (cells_blocks[cells_index[cp >> 8]][(cp & 0xFF) >> 2] >> ((cp & 3) * 2)) & 3;
+}
+
+int utf8_ncells(const char *s, size_t n) {
+  size_t i     = 0;
+  int    cells = 0;
+
+  while (i < n) {
+    unsigned char ch = s[i];
+    unsigned int  length;
+    uint32_t      cp;
+    unsigned int  k;
+
+    // ASCII takes a cell, without decoding
+    if (ch < 0x80) {
+      cells++;
+      i++;
+      continue;
+    }
+
+    length = utf8_width(ch);
+    if (length == 1 || i + length > n) {
+      cells++;
+      i++;
+      continue;
+    }
+
+    for (cp = ch & (0x7F >> length), k = 1; k < length; k++)
+      cp = (cp << 6) | (s[i + k] & 0x3F);
+
+    cells += utf8_cells(cp);
+    i += length;
+  }
+
+  return cells;
+}
+
 int utf8_wgetch(WINDOW *window, char *c) {
   unsigned int i;
   unsigned int c_width;
-  char ch = wgetch(window);
+  int ch = wgetch(window);
 
   if (ch == ERR)
     return ERR;
 
+  // Function keys are passed through as their key code
+  if (ch >= KEY_MIN) {
+    c[0] = c[1] = c[2] = c[3] = c[4] = c[5] = c[6] = '\0';
+    return ch;
+  }
+
   c[0] = ch;
 
   // Grab full utf8 character
@@ -59,3 +374,66 @@ int utf8_wgetch(WINDOW *window, char *c) {
 
   return c_width;
 }
+
+
+/**
+ * Internal functions
+ */
+
+#if defined(__SSSE3__)
+__m128i internal_classify16(__m128i v, __m128i prev) {
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  __m128i       prev1  = _mm_alignr_epi8(v, prev, 15);
+  __m128i       prev2  = _mm_alignr_epi8(v, prev, 14);
+  __m128i       prev3  = _mm_alignr_epi8(v, prev, 13);
+  __m128i       special;
+  __m128i       continuation;
+
+  special = _mm_and_si128(
+      _mm_and_si128(
+          _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_1_high), _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+          _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_1_low), _mm_and_si128(prev1, nibble))),
+      _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_2_high), _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+
+  // Third and fourth bytes of a sequence must be continuation bytes, and only
+  // these may follow a continuation byte (the high bit of TWO_CONTS)
+  continuation = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80)), _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80)));
+
+  return _mm_xor_si128(_mm_and_si128(continuation, _mm_set1_epi8((char)0x80)), special);
+}
+
+size_t internal_boundary(const unsigned char *u, size_t i) {
+  size_t k = 0;
+
+  // Up to three continuation bytes back to the lead byte, if any
+  while (k < 3 && k < i && (u[i - k - 1] & 0xC0) == 0x80)
+    k++;
+
+  if (k < i && u[i - k - 1] >= 0xC0)
+    return (i - k - 1);
+
+  return i;
+}
+#endif
+
+#if defined(__AVX2__)
+__m256i internal_classify32(__m256i v, __m256i prev) {
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  __m256i       before = _mm256_permute2x128_si256(prev, v, 0x21); // Previous 16 bytes of each lane
+  __m256i       prev1  = _mm256_alignr_epi8(v, before, 15);
+  __m256i       prev2  = _mm256_alignr_epi8(v, before, 14);
+  __m256i       prev3  = _mm256_alignr_epi8(v, before, 13);
+  __m256i       special;
+  __m256i       continuation;
+
+  special = _mm256_and_si256(
+      _mm256_and_si256(
+          _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_1_high)), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+          _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_1_low)), _mm256_and_si256(prev1, nibble))),
+      _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_2_high)), _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+
+  continuation = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)), _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80)));
+
+  return _mm256_xor_si256(_mm256_and_si256(continuation, _mm256_set1_epi8((char)0x80)), special);
+}
+#endif
@@ -2,6 +2,9 @@
 #define UTF8_H 1
 
 #include <ncurses.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Determine the byte length of a UTF8 character based on the first char.
@@ -21,13 +24,72 @@ unsigned int utf8_width(char ch);
  */
 int utf8_characters(char *s);
 
+/**
+ * Get the UTF8 character count for a span of bytes. Only lead bytes are
+ * counted, so counts of adjacent spans can be added together. Vectorised with
+ * SSE2/AVX2 where available.
+ *
+ * @param s [const char *] Bytes to count
+ * @param n [size_t] Number of bytes
+ *
+ * @return [int] Character count
+ */
+int utf8_ncharacters(const char *s, size_t n);
+
+/**
+ * Find the first line break in a span of bytes, counting the UTF8 characters
+ * before it in the same pass. Vectorised with SSE2/AVX2 where available.
+ *
+ * @param s [const char *] Bytes to scan
+ * @param n [size_t] Number of bytes
+ * @param characters [int *] Set to the character count before the line break
+ *
+ * @return [size_t] Offset of the line break, or `n` if there is none
+ */
+size_t utf8_line(const char *s, size_t n, int *characters);
+
+/**
+ * Check that a span of bytes is well-formed UTF8 (no overlong forms,
+ * surrogates or code points above U+10FFFF). Where SSSE3/AVX2 is available,
+ * whole vectors are classified with lookup tables, ASCII or not. Otherwise
+ * runs of ASCII are skipped a vector at a time (SSE2) and the rest is decoded.
+ *
+ * @param s [const char *] Bytes to check
+ * @param n [size_t] Number of bytes
+ *
+ * @return [bool] True if well-formed
+ */
+bool utf8_valid(const char *s, size_t n);
+
+/**
+ * Get the number of terminal cells a code point takes, from a built-in table
+ * generated from the C library's `wcwidth` (see cells.h).
+ *
+ * @param cp [uint32_t] Code point
+ *
+ * @return [int] 0 (combining and format characters), 1 or 2 (wide characters)
+ */
+int utf8_cells(uint32_t cp);
+
+/**
+ * Get the number of terminal cells a span of bytes takes. Malformed bytes take
+ * a cell each.
+ *
+ * @param s [const char *] Bytes to measure
+ * @param n [size_t] Number of bytes
+ *
+ * @return [int] Width in cells
+ */
+int utf8_ncells(const char *s, size_t n);
+
 /**
  * Get a UTF8 character from the given window.
  *
  * @param window [WINDOW] Window to get the character from
  * @param c [char *] Pointer to copy (potentially) multi-byte character to (e.g. 7-byte string)
  *
- * @return [int] The length in bytes of the character copited, or `ERR` if no input present
+ * @return [int] The length in bytes of the character copited, the key code (`KEY_MIN` or
+ *   above) for function keys, or `ERR` if no input present
  */
 int utf8_wgetch(WINDOW *window, char *c);
 
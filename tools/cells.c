@@ -0,0 +1,119 @@
+#define _XOPEN_SOURCE 700 // wcwidth
+
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+/**
+ * Generate src/cells.h, the terminal cells taken by each code point, from the
+ * C library's `wcwidth`. curses measures characters with it, so the editor's
+ * columns agree with where curses puts them. Run with `make cells`.
+ */
+
+/* Constants */
+#define CODEPOINTS 0x110000      // Code points in Unicode
+#define BLOCKSIZ   256           // Code points a block covers
+#define BLOCKS     (CODEPOINTS / BLOCKSIZ)
+#define BYTES      (BLOCKSIZ / 4) // Bytes a block takes, 2 bits a code point
+
+/* Internal function prototypes */
+static int  cells(wchar_t cp);    // Cells curses draws a code point in
+static void print_row(const uint8_t *values, size_t count, const char *indent, const char *format); // Print a table row
+
+/* State variables */
+static uint8_t blocks[BLOCKS][BYTES]; // Distinct blocks, in order of first use
+static uint8_t block_of[BLOCKS];      // Distinct block of each block
+
+int main(void) {
+  uint8_t block[BYTES];
+  size_t  count = 0;
+  size_t  i;
+  size_t  k;
+
+  if (setlocale(LC_CTYPE, "C.UTF-8") == NULL && setlocale(LC_CTYPE, "en_US.UTF-8") == NULL) {
+    fprintf(stderr, "cells: No UTF-8 locale\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < BLOCKS; i++) {
+    memset(block, 0, sizeof(block));
+    for (k = 0; k < BLOCKSIZ; k++)
+      block[k / 4] |= cells((wchar_t)(i * BLOCKSIZ + k)) << ((k % 4) * 2);
+
+    for (k = 0; k < count && memcmp(blocks[k], block, BYTES) != 0; k++);
+
+    if (k == count) {
+      if (count == 256) {
+        fprintf(stderr, "cells: Over 256 distinct blocks\n");
+        return EXIT_FAILURE;
+      }
+      memcpy(blocks[count++], block, BYTES);
+    }
+
+    block_of[i] = k;
+  }
+
+  printf("#ifndef CELLS_H\n");
+  printf("#define CELLS_H 1\n\n");
+  printf("#include <stdint.h>\n\n");
+  printf("/**\n");
+  printf(" * Terminal cells taken by each code point, as a two-level table: the high bits\n");
+  printf(" * of a code point select one of the distinct 256 code point blocks, which\n");
+  printf(" * holds 2 bits per code point (0, 1 or 2 cells).\n");
+  printf(" *\n");
+  printf(" * Generated by tools/cells.c (make cells) from the C library's wcwidth, which\n");
+  printf(" * curses measures characters with. Code points it has no width for take one\n");
+  printf(" * cell, except C0 controls and DEL that curses shows as ^X.\n");
+  printf(" */\n\n");
+  printf("#define CELLS_BLOCKS %zu // Distinct blocks\n\n", count);
+
+  printf("static const uint8_t cells_index[0x%X] = {\n", BLOCKS);
+  for (i = 0; i < BLOCKS; i += 16)
+    print_row((block_of + i), 16, " ", "%4u,");
+  printf("};\n\n");
+
+  printf("static const uint8_t cells_blocks[CELLS_BLOCKS][%d] = {\n", BYTES);
+  for (i = 0; i < count; i++) {
+    printf("  { // %zu\n", i);
+    for (k = 0; k < BYTES; k += 16)
+      print_row((blocks[i] + k), 16, "   ", " 0x%02x,");
+    printf("  },\n");
+  }
+  printf("};\n\n");
+  printf("#endif\n");
+
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * Internal functions
+ */
+
+int cells(wchar_t cp) {
+  int width;
+
+  // Tabs are left to curses, which expands them
+  if (cp == '\t')
+    return 1;
+  if (cp < 0x20 || cp == 0x7F)
+    return 2;
+
+  // Unassigned code points, C1 controls and surrogates, curses puts in one
+  if ((width = wcwidth(cp)) < 0)
+    return 1;
+
+  return width;
+}
+
+void print_row(const uint8_t *values, size_t count, const char *indent, const char *format) {
+  size_t i;
+
+  printf("%s", indent);
+  for (i = 0; i < count; i++)
+    printf(format, values[i]);
+  printf("\n");
+}